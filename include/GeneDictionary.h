@@ -0,0 +1,131 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** GeneDictionary.h
+** Interned gene names with dense ids.
+**
+** Ids index a plain array of names, so id -> name is a lookup and the names
+** are stored once. name -> id goes through an open-addressing hash table
+** (linear probing, kept at most half full) holding ids.
+**
+** Ids normally double as matrix rows: add() always appends, and a name added
+** twice resolves to its later id, like assigning into a std::map would.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef GENEDICTIONARY_H
+#define GENEDICTIONARY_H
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <stdint.h>
+
+class GeneDictionary {
+ public:
+  GeneDictionary(void) : mMask(0) {}
+
+  int size(void) const { return (int)mNames.size(); }
+  bool empty(void) const { return mNames.empty(); }
+  const std::string& name(const int id) const { return mNames[id]; }
+  const std::vector<std::string>& names(void) const { return mNames; }
+
+  // Id of name, or -1 when it is not in the dictionary.
+  int find(const char* name, const size_t length) const {
+    if (mSlots.empty()) {
+      return -1;
+    }
+    for (size_t slot = hash(name, length) & mMask; ; slot = (slot + 1) & mMask) {
+      const int id = mSlots[slot];
+      if (id < 0) {
+	return -1;
+      }
+      const std::string& s = mNames[id];
+      if (s.size() == length && memcmp(s.data(), name, length) == 0) {
+	return id;
+      }
+    }
+  }
+  int find(const std::string& name) const { return find(name.data(), name.size()); }
+  bool contains(const std::string& name) const { return find(name) >= 0; }
+
+  // Append name under the next id. A name already present now resolves to
+  // the new id.
+  int add(const std::string& name) {
+    const int id = (int)mNames.size();
+    mNames.push_back(name);
+    if (2 * mNames.size() > mSlots.size()) {
+      rehash(mSlots.empty() ? 16 : 2 * mSlots.size());
+    } else {
+      insert(id);
+    }
+    return id;
+  }
+
+  // Id of name, adding it first if it is new.
+  int intern(const std::string& name) {
+    const int id = find(name);
+    return (id >= 0) ? id : add(name);
+  }
+  int intern(const char* name, const size_t length) {
+    const int id = find(name, length);
+    return (id >= 0) ? id : add(std::string(name, length));
+  }
+
+  void reserve(const size_t n) {
+    mNames.reserve(n);
+    size_t slots(16);
+    while (slots < 2 * n) {
+      slots *= 2;
+    }
+    if (slots > mSlots.size()) {
+      rehash(slots);
+    }
+  }
+
+  void clear(void) {
+    mNames.clear();
+    mSlots.clear();
+    mMask = 0;
+  }
+
+ private:
+  // FNV-1a
+  static size_t hash(const char* s, const size_t length) {
+    uint64_t h(14695981039346656037ULL);
+    for (size_t i = 0; i < length; ++i) {
+      h ^= (unsigned char)s[i];
+      h *= 1099511628211ULL;
+    }
+    return (size_t)(h ^ (h >> 32));
+  }
+
+  // Point name's slot at id, replacing an earlier id for the same name.
+  void insert(const int id) {
+    const std::string& s = mNames[id];
+    for (size_t slot = hash(s.data(), s.size()) & mMask; ; slot = (slot + 1) & mMask) {
+      const int other = mSlots[slot];
+      if (other < 0 || mNames[other] == s) {
+	mSlots[slot] = id;
+	return;
+      }
+    }
+  }
+
+  void rehash(const size_t slots) {
+    mSlots.assign(slots, -1);
+    mMask = slots - 1;
+    for (int id = 0; id < (int)mNames.size(); ++id) {
+      insert(id);
+    }
+  }
+
+  std::vector<std::string> mNames;
+  std::vector<int> mSlots;
+  size_t mMask;
+};
+
+#endif
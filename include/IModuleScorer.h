@@ -15,22 +15,155 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <ostream>
+#include <cstring>
+#include <stdint.h>
+#include "SimilarityMatrix.h"
+#include "GeneDictionary.h"
 
 typedef std::vector<int> TIndices;
 //typedef std::vector<TIndices> TIndicesGroups;
 typedef std::map<std::string, TIndices> TIndicesGroups;
 typedef std::map<int, float> TScoreMap;
-typedef std::map<int, std::string> TReverseIndexMap;
 
 class IModuleScorer {
  public:
   virtual ~IModuleScorer() {}
-  virtual bool ScoreModule(const float* const similarities, const int width,
+  virtual bool ScoreModule(const SimilarityMatrix& similarities,
 			   const TIndicesGroups& groups, 
 			   const TIndices& indicesToScore,
 			   TScoreMap& scores) const = 0;
-  virtual void BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::ostream& outstream) const = 0;
-  virtual void LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TIndicesGroups& groups, std::ostream& out) const = 0;
+  virtual void BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& outstream) const = 0;
+  virtual void LongSummary(TScoreMap& scores, const GeneDictionary& genes, const TIndicesGroups& groups, std::ostream& out) const = 0;
 };
 
+// The similarities among the genes a module is scored over, copied out of
+// the full matrix once and laid out locus by locus: the genes of each group
+// in turn, then any other genes to score. The scorers then read a few
+// neighbouring rows instead of hopping across the whole matrix. Each row is
+// padded to whole cache lines and starts on one.
+class LocusBlock {
+ public:
+  // Blocks above this size are not worth the copy; the matrix is scored in
+  // place instead.
+  static const size_t kMaxBytes = (size_t)256 << 20;
+  static const int kLineFloats = 64 / sizeof(float);
+
+ LocusBlock(const TIndicesGroups& groups, const TIndices& indicesToScore) : mData(0) {
+    std::map<int, int> local;
+    auto add = [&](const int i) {
+      auto found = local.find(i);
+      if (found != local.end()) {
+	return found->second;
+      }
+      local[i] = (int)mGenes.size();
+      mGenes.push_back(i);
+      return (int)mGenes.size() - 1;
+    };
+    for (auto const& g : groups) {
+      TIndices& inds = mGroups[g.first];
+      for (auto const i : g.second) {
+	inds.push_back(add(i));
+      }
+    }
+    for (auto const i : indicesToScore) {
+      mIndicesToScore.push_back(add(i));
+    }
+    mStride = (mGenes.size() + kLineFloats - 1) / kLineFloats * kLineFloats;
+  }
+
+  int size() const { return (int)mGenes.size(); }
+  size_t bytes() const { return sizeof(float) * mStride * mGenes.size(); }
+  const TIndicesGroups& groups() const { return mGroups; }
+  const TIndices& indicesToScore() const { return mIndicesToScore; }
+  DenseSimilarities similarities() const { return DenseSimilarities(mData, size(), mStride); }
+
+  template <typename M>
+  void fill(const M& similarities) {
+    allocate();
+    for (size_t a = 0; a < mGenes.size(); ++a) {
+      gatherSimilarities(similarities, mGenes[a], &mGenes[0], mGenes.size(), mData + mStride * a);
+    }
+  }
+  // The factor is multiplied out with one matrix product into unpadded rows,
+  // which are then spread out to their strides, last first.
+  void fill(const FactorSimilarities& similarities) {
+    allocate();
+    const size_t n = mGenes.size();
+    if (n > 0) {
+      similarities.block(mGenes, mData);
+    }
+    for (size_t a = n; a-- > 1; ) {
+      memmove(mData + mStride * a, mData + n * a, sizeof(float) * n);
+    }
+  }
+
+  // Scores by block index back to scores by full index.
+  void unmap(const TScoreMap& local, TScoreMap& scores) const {
+    for (auto const& s : local) {
+      scores[mGenes[s.first]] = s.second;
+    }
+  }
+
+ private:
+  void allocate() {
+    mStorage.assign(mStride * mGenes.size() + kLineFloats, 0.0f);
+    const uintptr_t address = (uintptr_t)mStorage.data();
+    mData = mStorage.data() + ((64 - address % 64) % 64) / sizeof(float);
+  }
+
+  std::vector<int> mGenes;
+  TIndicesGroups mGroups;
+  TIndices mIndicesToScore;
+  size_t mStride;
+  std::vector<float> mStorage;
+  float* mData;
+};
+
+// Forwards ScoreModule to a scorer's Score<M>() template for the concrete
+// layout of the similarity matrix. Unless it would be too large, the
+// LocusBlock of the module is gathered first and scored instead. A factor
+// is always multiplied out into its block; scorers look most pairs up
+// several times.
+template <typename S>
+class TScoreModuleCall {
+ public:
+ TScoreModuleCall(const S& scorer, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores)
+   : mScorer(scorer), mGroups(groups), mIndicesToScore(indicesToScore), mScores(scores) {}
+  template <typename M>
+  bool operator()(const M& similarities) {
+    LocusBlock block(mGroups, mIndicesToScore);
+    if (block.bytes() > LocusBlock::kMaxBytes) {
+      return mScorer.Score(similarities, mGroups, mIndicesToScore, mScores);
+    }
+    block.fill(similarities);
+    return scoreBlock(block);
+  }
+  bool operator()(const FactorSimilarities& similarities) {
+    LocusBlock block(mGroups, mIndicesToScore);
+    block.fill(similarities);
+    return scoreBlock(block);
+  }
+ private:
+  bool scoreBlock(const LocusBlock& block) {
+    TScoreMap scores;
+    const bool ok = mScorer.Score(block.similarities(), block.groups(), block.indicesToScore(), scores);
+    block.unmap(scores, mScores);
+    return ok;
+  }
+
+  const S& mScorer;
+  const TIndicesGroups& mGroups;
+  const TIndices& mIndicesToScore;
+  TScoreMap& mScores;
+};
+
+template <typename S>
+bool dispatchScoreModule(const S& scorer, const SimilarityMatrix& similarities, const TIndicesGroups& groups,
+			 const TIndices& indicesToScore, TScoreMap& scores)
+{
+  TScoreModuleCall<S> call(scorer, groups, indicesToScore, scores);
+  return dispatchSimilarities(similarities, call);
+}
+
 #endif
@@ -0,0 +1,297 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** SimilarityMatrix.h
+** Storage layouts for the gene similarity matrix and the sim(i, j) accessors
+** the scorers are written against.
+**
+** Scorers are templates over the concrete layout so lookups stay inlined;
+** dispatchSimilarities() picks the instantiation at run time.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef SIMILARITYMATRIX_H
+#define SIMILARITYMATRIX_H
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+enum TSimilarityLayout {
+  kDenseLayout,
+  kPackedLayout,
+  kSparseLayout,
+  kFactorLayout,
+  kHalfLayout,
+  kInt8Layout
+};
+
+class SimilarityMatrix {
+ public:
+ SimilarityMatrix(const TSimilarityLayout layout, const int width): mLayout(layout), mWidth(width) {}
+  virtual ~SimilarityMatrix() {}
+  TSimilarityLayout layout() const { return mLayout; }
+  int width() const { return mWidth; }
+ protected:
+  const TSimilarityLayout mLayout;
+  const int mWidth;
+};
+
+// Full row-major width * width matrix. Rows are stride floats apart, which
+// is width unless they are padded.
+class DenseSimilarities : public SimilarityMatrix {
+ public:
+ DenseSimilarities(const float* const data, const int width)
+   : SimilarityMatrix(kDenseLayout, width), mData(data), mStride(width) {}
+ DenseSimilarities(const float* const data, const int width, const size_t stride)
+   : SimilarityMatrix(kDenseLayout, width), mData(data), mStride(stride) {}
+  float operator()(const int i, const int j) const { return mData[mStride * i + j]; }
+  const float* row(const int i) const { return mData + mStride * i; }
+  const float* data() const { return mData; }
+  size_t stride() const { return mStride; }
+ private:
+  const float* const mData;
+  const size_t mStride;
+};
+
+// Upper triangle of a symmetric matrix, diagonal included, packed row by
+// row: row i holds columns i..width-1.
+class PackedSimilarities : public SimilarityMatrix {
+ public:
+ PackedSimilarities(const float* const data, const int width)
+   : SimilarityMatrix(kPackedLayout, width), mData(data), mRowStart(width)
+  {
+    // mRowStart[i] + j is the offset of (i, j) for j >= i.
+    size_t offset(0);
+    for (int i = 0; i < width; ++i) {
+      mRowStart[i] = offset - i;
+      offset += width - i;
+    }
+  }
+  float operator()(const int i, const int j) const {
+    return (i <= j) ? mData[mRowStart[i] + j] : mData[mRowStart[j] + i];
+  }
+  const float* data() const { return mData; }
+  static size_t packedSize(const int width) { return (size_t)width * (width + 1) / 2; }
+ private:
+  const float* const mData;
+  std::vector<size_t> mRowStart;
+};
+
+// Symmetric matrix that keeps only selected pairs, in compressed sparse row
+// form: the columns of row i are mColumns[mRowStart[i]..mRowStart[i + 1]),
+// sorted, with their values alongside. Pairs that were not kept read as
+// missingValue. Built by SparseSimilaritiesBuilder.
+class SparseSimilarities : public SimilarityMatrix {
+ public:
+  // Takes over the contents of the vectors.
+ SparseSimilarities(const int width, const float missingValue, std::vector<size_t>& rowStart,
+		    std::vector<int>& columns, std::vector<float>& values)
+   : SimilarityMatrix(kSparseLayout, width), mMissing(missingValue)
+  {
+    mRowStart.swap(rowStart);
+    mColumns.swap(columns);
+    mValues.swap(values);
+  }
+  float operator()(const int i, const int j) const {
+    const int* const columns = mColumns.data();
+    const int* const begin = columns + mRowStart[i];
+    const int* const end = columns + mRowStart[i + 1];
+    const int* const it = std::lower_bound(begin, end, j);
+    return (it != end && *it == j) ? mValues[it - columns] : mMissing;
+  }
+  size_t numEntries() const { return mColumns.size(); }
+  size_t bytes() const {
+    return sizeof(size_t) * mRowStart.size() + (sizeof(int) + sizeof(float)) * mColumns.size();
+  }
+  float missingValue() const { return mMissing; }
+ private:
+  const float mMissing;
+  std::vector<size_t> mRowStart;
+  std::vector<int> mColumns;
+  std::vector<float> mValues;
+};
+
+// Low-rank factor of a symmetric positive semi-definite matrix, F F^T: row i
+// of the width x rank matrix F (row-major) holds gene i's coordinates, and
+// sim(i, j) is the dot product of two rows. Memory grows with width * rank
+// instead of width^2.
+class FactorSimilarities : public SimilarityMatrix {
+ public:
+ FactorSimilarities(const float* const data, const int width, const int rank)
+   : SimilarityMatrix(kFactorLayout, width), mData(data), mRank(rank) {}
+  float operator()(const int i, const int j) const {
+    const float* const a = mData + (size_t)mRank * i;
+    const float* const b = mData + (size_t)mRank * j;
+    float sum(0.0f);
+    for (int k = 0; k < mRank; ++k) {
+      sum += a[k] * b[k];
+    }
+    return sum;
+  }
+  // The dense submatrix among the given genes, row-major, multiplied out
+  // with a single matrix product.
+  void block(const std::vector<int>& indices, float* const out) const;
+  int rank() const { return mRank; }
+  const float* data() const { return mData; }
+ private:
+  const float* const mData;
+  const int mRank;
+};
+
+// IEEE half precision. Conversions round to nearest, ties to even; values
+// beyond the half range become infinite.
+inline float halfToFloat(const uint16_t h) {
+#if defined(__F16C__)
+  return _cvtsh_ss(h);
+#else
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13) | (mantissa ? 0x400000 : 0);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // Subnormal: shift the mantissa up until it is normal.
+    exponent = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+#endif
+}
+
+inline uint16_t floatToHalf(const float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  const uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude >= 0x7f800000) {
+    return sign | 0x7c00 | ((magnitude > 0x7f800000) ? 0x200 : 0);
+  }
+  if (magnitude >= 0x477ff000) {
+    return sign | 0x7c00;
+  }
+  if (magnitude < 0x38800000) {
+    // Subnormal or zero: the value in units of 2^-24, rounded.
+    if (magnitude < 0x33000000) {
+      return sign;
+    }
+    const uint32_t shift = 126 - (magnitude >> 23);
+    const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+    uint32_t h = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t half = 1u << (shift - 1);
+    if (rest > half || (rest == half && (h & 1))) {
+      h++;
+    }
+    return sign | h;
+  }
+  uint32_t h = (magnitude - 0x38000000) >> 13;
+  const uint32_t rest = magnitude & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+    h++;
+  }
+  return sign | h;
+}
+
+// Full row-major width * width matrix in half precision, at half the memory
+// of DenseSimilarities. Relative error is at most 2^-11 down to 6e-5;
+// smaller values keep a fixed absolute error of 3e-8.
+class HalfSimilarities : public SimilarityMatrix {
+ public:
+ HalfSimilarities(const uint16_t* const data, const int width)
+   : SimilarityMatrix(kHalfLayout, width), mData(data) {}
+  float operator()(const int i, const int j) const { return halfToFloat(mData[(size_t)mWidth * i + j]); }
+  // out[k] = sim(i, columns[k]) for k < n, eight at a time with F16C when
+  // the processor has it.
+  void gather(const int i, const int* const columns, const int n, float* const out) const;
+  const uint16_t* data() const { return mData; }
+ private:
+  const uint16_t* const mData;
+};
+
+// Full row-major width * width matrix of signed bytes, a quarter of the
+// memory of DenseSimilarities. Row i is scaled by scales[i] so that its
+// largest off-diagonal magnitude is 127; the diagonal, usually far larger
+// than the rest of the row, is kept apart in full precision. Values in row
+// i are off by at most scales[i] / 2, so sim(i, j) and sim(j, i) can differ
+// by that much.
+class Int8Similarities : public SimilarityMatrix {
+ public:
+ Int8Similarities(const int8_t* const data, const float* const scales, const float* const diagonal, const int width)
+   : SimilarityMatrix(kInt8Layout, width), mData(data), mScales(scales), mDiagonal(diagonal) {}
+  float operator()(const int i, const int j) const {
+    return (i == j) ? mDiagonal[i] : mScales[i] * mData[(size_t)mWidth * i + j];
+  }
+  // out[k] = sim(i, columns[k]) for k < n, eight at a time with AVX2 when
+  // the processor has it.
+  void gather(const int i, const int* const columns, const int n, float* const out) const;
+  const int8_t* data() const { return mData; }
+  const float* scales() const { return mScales; }
+  const float* diagonal() const { return mDiagonal; }
+ private:
+  const int8_t* const mData;
+  const float* const mScales;
+  const float* const mDiagonal;
+};
+
+// out[k] = sim(i, columns[k]) for k < n. Scorers read the values between one
+// gene and a whole group this way; reduced-precision layouts widen them with
+// vector instructions where the processor has them.
+template <typename M>
+inline void gatherSimilarities(const M& similarities, const int i, const int* const columns, const int n,
+			       float* const out) {
+  for (int k = 0; k < n; ++k) {
+    out[k] = similarities(i, columns[k]);
+  }
+}
+
+inline void gatherSimilarities(const HalfSimilarities& similarities, const int i, const int* const columns,
+			       const int n, float* const out) {
+  similarities.gather(i, columns, n, out);
+}
+
+inline void gatherSimilarities(const Int8Similarities& similarities, const int i, const int* const columns,
+			       const int n, float* const out) {
+  similarities.gather(i, columns, n, out);
+}
+
+template <typename F>
+bool dispatchSimilarities(const SimilarityMatrix& similarities, F& f)
+{
+  switch (similarities.layout()) {
+  case kPackedLayout:
+    return f(static_cast<const PackedSimilarities&>(similarities));
+  case kSparseLayout:
+    return f(static_cast<const SparseSimilarities&>(similarities));
+  case kFactorLayout:
+    return f(static_cast<const FactorSimilarities&>(similarities));
+  case kHalfLayout:
+    return f(static_cast<const HalfSimilarities&>(similarities));
+  case kInt8Layout:
+    return f(static_cast<const Int8Similarities&>(similarities));
+  case kDenseLayout:
+  default:
+    return f(static_cast<const DenseSimilarities&>(similarities));
+  }
+}
+
+#endif
@@ -12,8 +12,10 @@
 
 #include "CompleteGraphScorer.h"
 #include "coreroutines.h"
+#include "ScoreKernels.h"
 #include "string.h"
 #include <algorithm>
+#include <type_traits>
 #include <cfloat>
 #include <cmath>
 
@@ -128,7 +130,7 @@ bool scoreCompare(const std::pair<int, float>& firstElem, const std::pair<int, f
   return firstElem.second > secondElem.second;
 }
 
-void BaseScorer::BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::ostream& out) const {
+void BaseScorer::BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const {
   
   std::vector<std::pair<int, float> > pairs;
   sortMapByVal(scores, pairs, scoreCompare);
@@ -136,11 +138,20 @@ void BaseScorer::BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::os
   out << std::endl << "Top 10 genes" << std::endl << "Gene\tScore" << std::endl << "----------------" << std::endl;
   int i = 0;
   for (auto it = pairs.begin(); it != pairs.end() && i < 10; it++, i++) {
-    out << rmap[it->first] << "\t" << it->second << std::endl;
+    out << genes.name(it->first) << "\t" << it->second << std::endl;
   }
 }
 
-void BaseScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TIndicesGroups& groups, std::ostream& out) const
+void CompleteGraphFasterScorer::BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const {
+  const uint64_t total = mEvaluated + mPruned;
+  if (total > 0) {
+    out << "Branch and bound scored " << mEvaluated << " of " << total << " partial cliques ("
+	<< 100.0 * mPruned / total << "% pruned)." << std::endl;
+  }
+  BaseScorer::BriefSummary(scores, genes, out);
+}
+
+void BaseScorer::LongSummary(TScoreMap& scores, const GeneDictionary& genes, const TIndicesGroups& groups, std::ostream& out) const
 {
   std::map<int, std::string> groupMap;
   int i = 0;
@@ -155,7 +166,7 @@ void BaseScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TI
   sortMapByVal(scores, pairs, scoreCompare);
   out << "locus\tgene\tscore" << std::endl;
   for (auto const &e : pairs) {
-    out << groupMap[e.first] << "\t" << rmap[e.first] << "\t" << scores[e.first] << std::endl;
+    out << groupMap[e.first] << "\t" << genes.name(e.first) << "\t" << scores[e.first] << std::endl;
   }
 }
 
@@ -290,414 +301,461 @@ void BaseScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TI
 // }
 
 
-float score_complete3(const int score_node, const std::vector< std::vector<int> >& other_groups, const float* const similarities, const int width)
+// A locus's nodes, borrowed from the groups being scored rather than copied.
+// id is the group's position among all the module's groups.
+struct TGroupView {
+  const int* nodes;
+  size_t count;
+  int id;
+  size_t size() const { return count; }
+  int operator[](const size_t i) const { return nodes[i]; }
+};
+
+// Upper bounds on similarities between the module's groups, computed once
+// per module and shared by every candidate: node(g, i, h) is the largest
+// similarity of node i of group g to any node of group h, and pair(g, h) the
+// largest between any two nodes of g and h.
+struct TGroupBounds {
+  int numGroups;
+  std::vector<size_t> start;
+  std::vector<float> nodeMax;
+  std::vector<float> pairMax;
+  float node(const int g, const size_t i, const int h) const { return nodeMax[(start[g] + i) * numGroups + h]; }
+  float pair(const int g, const int h) const { return pairMax[(size_t)g * numGroups + h]; }
+};
+
+// Scratch space for scoring one candidate. Each thread keeps its own and
+// reuses it, so once it has grown to fit the module nothing is allocated.
+struct TScoreArena {
+  TScoreArena() : largest(0), evaluated(0), pruned(0) {}
+  // me's similarity to each node, group after group, and its largest to
+  // each group.
+  std::vector<float> me;
+  std::vector<size_t> meStart;
+  std::vector<float> meMax;
+  // The chosen nodes' similarities to whole groups, for the kernels, and
+  // the size of the largest group.
+  std::vector<float> rows;
+  size_t largest;
+  std::vector<std::pair<int, float> > maxima;
+  std::vector<std::pair<float, int> > order;
+  std::vector<TGroupView> top;
+  // Kernel calls made, and those cut by the bounds.
+  uint64_t evaluated, pruned;
+  const float* values(const int group) const { return me.data() + meStart[group]; }
+};
+
+// me's similarity to each node of every group, read a group at a time, into
+// the arena, noting the size of the largest group.
+template <typename M>
+void group_similarities(const int me, const M& similarities, const std::vector<TGroupView>& groups,
+			TScoreArena& arena)
 {
-  const float* const me_base = similarities + (width * score_node);
-  std::vector< std::vector<int> > combinations;
-  comb(other_groups.size(), 2, combinations);
-  float score(0.0f);
-  
-  for (auto const& combination : combinations) {
-    float maxscore = -FLT_MAX;
-    const auto ig1 = combination[0];
-    const auto g1 = other_groups[ig1];
-    const auto ig2 = combination[1];
-    const auto g2 = other_groups[ig2];
-
-    for (const auto n1 : g1) {
-      const float me_n1 = me_base[n1];
-      const float* n1_base = similarities + (width * n1);
-      const float curr_outer(me_n1);
-      for (const auto n2 : g2) {
-	const float me_n2 = me_base[n2];
-	const float* n2_base = similarities + (width * n2);
-	const float n1_n2 = n1_base[n2];
-	float curr(curr_outer + me_n2);
-	//float v = (me_n1 < me_n2) ? me_n1 : me_n2;
-	//v = (v < n1_n2) ? v : n1_n2;
-	//float v = (n1_n2 < me_n1) ? n1_n2 : me_n1;
-	//v = (v < me_n2) ? v : me_n2;
-	//curr += v;
-	curr += n1_n2;
-	maxscore = (curr > maxscore) ? curr : maxscore;
+  size_t total(0), largest(0);
+  arena.meStart.resize(groups.size() + 1);
+  arena.meMax.resize(groups.size());
+  for (size_t i = 0; i < groups.size(); ++i) {
+    arena.meStart[i] = total;
+    total += groups[i].size();
+    largest = std::max(largest, groups[i].size());
+  }
+  arena.meStart[groups.size()] = total;
+  arena.me.resize(total);
+  for (size_t i = 0; i < groups.size(); ++i) {
+    float mx(-FLT_MAX);
+    if (groups[i].size() > 0) {
+      float* const values = &arena.me[arena.meStart[i]];
+      gatherSimilarities(similarities, me, groups[i].nodes, groups[i].size(), values);
+      for (size_t k = 0; k < groups[i].size(); ++k) {
+	mx = (values[k] > mx) ? values[k] : mx;
       }
     }
-    if (maxscore > -FLT_MAX) score += maxscore;
+    arena.meMax[i] = mx;
   }
-  return score;
+  arena.largest = largest;
 }
 
-float score_complete4(const int score_node, const std::vector< std::vector<int> >& other_groups, const float* const similarities, const int width)
+// n's similarity to each node of group, into values.
+template <typename M>
+void gather_group(const int n, const M& similarities, const TGroupView& group, float* const values)
 {
-  const float* const me_base = similarities + (width * score_node);
-  std::vector< std::vector<int> > combinations;
-  comb(other_groups.size(), 3, combinations);
-  float score(0.0f);
-  const float mult(1.0);
-  
-  for (auto const& combination : combinations) {
-    float maxscore = -FLT_MAX;
-    const auto ig1 = combination[0];
-    const auto g1 = other_groups[ig1];
-    const auto ig2 = combination[1];
-    const auto g2 = other_groups[ig2];
-    const auto ig3 = combination[2];
-    const auto g3 = other_groups[ig3];
-
-    for (const auto n1 : g1) {
-      const float me_n1 = me_base[n1];
-      const float* n1_base = similarities + (width * n1);
-      const float curr_outer(mult * me_n1);
-      for (const auto n2 : g2) {
-	const float me_n2 = me_base[n2];
-	const float* n2_base = similarities + (width * n2);
-	const float n1_n2 = n1_base[n2];
-	const float curr_middle(curr_outer + mult * me_n2);
-	for (const auto n3 : g3) {
-	  const float me_n3 = me_base[n3];
-	  float curr(curr_middle + mult * me_n3 + n1_n2);
-	  const float n2_n3 = n2_base[n3];
-	  const float n1_n3 = n1_base[n3];
-	  curr += n1_n3;
-	  curr += n2_n3;
-	  maxscore = (curr > maxscore) ? curr : maxscore;
-	}
-      }
-    }
-    if (maxscore > -FLT_MAX) score += maxscore;
+  if (group.size() > 0) {
+    gatherSimilarities(similarities, n, group.nodes, group.size(), values);
   }
-  return score;
 }
 
-
-float score_complete5(const int score_node, const std::vector< std::vector<int> >& other_groups, const float* const similarities, const int width)
+// The bounds between every pair of the module's groups, a group per task.
+template <typename M>
+void group_bounds(const M& similarities, const std::vector<TGroupView>& groups, ThreadPool& pool,
+		  TGroupBounds& bounds)
 {
-  const float* const me_base = similarities + (width * score_node);
-  std::vector< std::vector<int> > combinations;
-  comb(other_groups.size(), 4, combinations);
-  float score(0.0f);
-  
-  for (auto const& combination : combinations) {
-    float maxscore = -FLT_MAX;
-    const auto ig1 = combination[0];
-    const auto g1 = other_groups[ig1];
-    const auto ig2 = combination[1];
-    const auto g2 = other_groups[ig2];
-    const auto ig3 = combination[2];
-    const auto g3 = other_groups[ig3];
-    const auto ig4 = combination[3];
-    const auto g4 = other_groups[ig4];
-
-    for (const auto n1 : g1) {
-      const float me_n1 = me_base[n1];
-      const float* n1_base = similarities + (width * n1);
-      const float curr_outer(me_n1);
-      for (const auto n2 : g2) {
-	const float me_n2 = me_base[n2];
-	const float* n2_base = similarities + (width * n2);
-	// n1_n2
-	const float n1_n2 = n1_base[n2];
-	//float v(n1_n2);
-	//float vv(me_n1);
-	//MIN(v, vv, me_n2);
-	float curr_middle(curr_outer + me_n2 + n1_n2);
-	for (const auto n3 : g3) {
-	  const float me_n3 = me_base[n3];
-	  const float* n3_base = similarities + (width * n3);
-	  // n1_n3
-	  const float n1_n3 = n1_base[n3];
-	  //v = n1_n3;
-	  //vv = me_n1;
-	  //MIN(v, vv, me_n3);
-	  // n2_n3
-	  const float n2_n3 = n2_base[n3];
-	  //vv = n2_n3;
-	  //float vvv(me_n2);
-	  //MIN(vv, vvv, me_n3);
-	  
-	  const float curr_middle2(curr_middle + me_n3 + n1_n3 + n2_n3);
-	  
-	  for (const auto n4 : g4) {
-	    const float me_n4 = me_base[n4];
-	    float curr(curr_middle2 + me_n4);
-	    // n1_n4
-	    //v = n1_base[n4];
-	    //vv = me_n1;
-	    //MIN(v, vv, me_n4);
-	    //curr += v;
-	    curr += n1_base[n4];
-	    // n2_n4
-	    //v = n2_base[n4];
-	    //vv = me_n2;
-	    //MIN(v, vv, me_n4);
-	    //curr += v;
-	    curr += n2_base[4];
-	    // n3_n4
-	    //v = n2_base[n4];
-	    //vv = me_n3;
-	    //MIN(v, vv, me_n4);
-	    //curr += v;
-	    curr += n3_base[n4];
-	    
-	    maxscore = (curr > maxscore) ? curr : maxscore;
+  const int numGroups = groups.size();
+  bounds.numGroups = numGroups;
+  bounds.start.resize(numGroups + 1);
+  size_t total(0), largest(0);
+  for (int g = 0; g < numGroups; ++g) {
+    bounds.start[g] = total;
+    total += groups[g].size();
+    largest = std::max(largest, groups[g].size());
+  }
+  bounds.start[numGroups] = total;
+  // A group's bound to itself is never used.
+  bounds.nodeMax.assign(total * numGroups, FLT_MAX);
+  pool.run(numGroups, [&](size_t g, int) {
+      std::vector<float> values(largest);
+      for (size_t i = 0; i < groups[g].size(); ++i) {
+	float* const row = &bounds.nodeMax[(bounds.start[g] + i) * numGroups];
+	for (int h = 0; h < numGroups; ++h) {
+	  if (h == (int)g) {
+	    continue;
 	  }
+	  gather_group(groups[g][i], similarities, groups[h], &values[0]);
+	  float mx(-FLT_MAX);
+	  for (size_t k = 0; k < groups[h].size(); ++k) {
+	    mx = (values[k] > mx) ? values[k] : mx;
+	  }
+	  row[h] = mx;
 	}
       }
+    });
+  bounds.pairMax.assign((size_t)numGroups * numGroups, -FLT_MAX);
+  for (int g = 0; g < numGroups; ++g) {
+    for (size_t i = 0; i < groups[g].size(); ++i) {
+      for (int h = 0; h < numGroups; ++h) {
+	float& mx = bounds.pairMax[(size_t)g * numGroups + h];
+	const float v = bounds.node(g, i, h);
+	mx = (v > mx) ? v : mx;
+      }
     }
-    if (maxscore > -FLT_MAX) score += maxscore;
   }
-  
-  return score;
 }
 
-// assignment into a and b
-#define MIN(a, b, c)			\
-  a = (a < b) ? a : b;		        \
-  a = (a < c) ? a : c;
+// Sort (bound, position) pairs, largest bound first.
+inline bool boundCompare(const std::pair<float, int>& a, const std::pair<float, int>& b) {
+  return a.first > b.first;
+}
 
-float score_complete3_clamped(const int score_node, const std::vector< std::vector<int> >& other_groups, const float* const similarities, const int width)
-{
-  const float* const me_base = similarities + (width * score_node);
-  std::vector< std::vector<int> > combinations;
-  comb(other_groups.size(), 2, combinations);
-  float score(0.0f);
-  
-  for (auto const& combination : combinations) {
-    float maxscore = -FLT_MAX;
-    const auto ig1 = combination[0];
-    const auto g1 = other_groups[ig1];
-    const auto ig2 = combination[1];
-    const auto g2 = other_groups[ig2];
-
-    for (const auto n1 : g1) {
-      const float me_n1 = me_base[n1];
-      const float* n1_base = similarities + (width * n1);
-      const float curr_outer(me_n1);
-      for (const auto n2 : g2) {
-	const float me_n2 = me_base[n2];
-	const float* n2_base = similarities + (width * n2);
-	const float n1_n2 = n1_base[n2];
-	float curr(curr_outer + me_n2);
-	float v(n1_n2);
-	MIN(v, me_n1, me_n2);
-	curr += v;
-	maxscore = (curr > maxscore) ? curr : maxscore;
+// Clamped scores limit the similarity between two nodes to the smaller of
+// their similarities to me.
+static inline float clampf(const float v, const float me_a, const float me_b) {
+  const float w = (v < me_a) ? v : me_a;
+  return (w < me_b) ? w : me_b;
+}
+
+// The best clique of me and one node from each of L = K - 1 groups, one
+// combination of groups at a time. When node j is chosen, its similarities
+// to every later group are gathered, and the nodes of the last group are
+// left to a vector kernel (see ScoreKernels.h). Everything sized by K is
+// known at compile time, so the loops over the chosen nodes unroll and
+// each level of the search is its own function.
+//
+// A clique's score is built in a fixed order, the one the kernels use:
+//   ((me_1 + ... + me_L-1) + me_L) + (n1_n2 + n1_n3 + n2_n3 + ...)
+//     + n1_nL + ... + nL-1_nL
+// or, clamped, with each pair added, clamped, straight after its later
+// node's me:
+//   (me_1 + me_2 + n1_n2 + me_3 + n1_n3 + n2_n3 + ...) + me_L + n1_nL + ...
+//
+// Branch and bound: bound(j) rebuilds that sum for every clique extending
+// the nodes chosen so far, with each value still unknown replaced by an
+// upper bound from TGroupBounds or meMax. Float addition and min are
+// monotonic, so the bound is never below a sum the kernel could return,
+// and a partial clique whose bound cannot beat the best so far is
+// skipped. Only the maximum of each combination is kept, so the result is
+// exactly that of the full search. The first group's nodes are visited
+// best bound first, so that the best rises early.
+template <int K, bool Clamp, typename M>
+class TCliqueSearch {
+ public:
+  static const int L = K - 1;
+
+ TCliqueSearch(const M& similarities, const TGroupBounds& bounds, TScoreArena& arena)
+   : mSimilarities(similarities), mBounds(bounds), mArena(arena), mKernels(scoreKernels()) {
+    mArena.rows.resize((size_t)L * L * mArena.largest);
+    for (int i = 0; i < L; ++i) {
+      for (int h = 0; h < L; ++h) {
+	mRows[i][h] = mArena.rows.data() + ((size_t)i * L + h) * mArena.largest;
       }
     }
-    if (maxscore > -FLT_MAX) score += maxscore;
   }
-  return score;
-}
 
-float score_complete4_clamped(const int score_node, const std::vector< std::vector<int> >& other_groups, const float* const similarities, const int width)
-{
-  const float* const me_base = similarities + (width * score_node);
-  std::vector< std::vector<int> > combinations;
-  comb(other_groups.size(), 3, combinations);
-  float score(0.0f);
-  const float mult(1.0);
-  
-  for (auto const& combination : combinations) {
-    float maxscore = -FLT_MAX;
-    const auto ig1 = combination[0];
-    const auto g1 = other_groups[ig1];
-    const auto ig2 = combination[1];
-    const auto g2 = other_groups[ig2];
-    const auto ig3 = combination[2];
-    const auto g3 = other_groups[ig3];
-
-    for (const auto n1 : g1) {
-      const float me_n1 = me_base[n1];
-      const float* n1_base = similarities + (width * n1);
-      const float curr_outer(mult * me_n1);
-      for (const auto n2 : g2) {
-	const float me_n2 = me_base[n2];
-	const float* n2_base = similarities + (width * n2);
-	const float n1_n2 = n1_base[n2];
-	// clamp n1_n2
-	float v(n1_n2);
-	MIN(v, me_n1, me_n2);
-	const float curr_middle(curr_outer + mult * me_n2 + v);
-	for (const auto n3 : g3) {
-	  const float me_n3 = me_base[n3];
-	  float curr(curr_middle + mult * me_n3);
-	  const float n1_n3 = n1_base[n3];
-	  const float n2_n3 = n2_base[n3];
-	  // clamp n1_n3
-	  v = n1_n3;
-	  MIN(v, me_n1, me_n3);
-	  curr += v;
-	  // clamp n2_n3
-	  v = n2_n3;
-	  MIN(v, me_n2, me_n3);
-	  curr += v;
-
-	  maxscore = (curr > maxscore) ? curr : maxscore;
-	}
+  // The best clique among groups[combination[0..L-1]], or -FLT_MAX if one
+  // of them is empty. me's similarities must already be in the arena.
+  float best(const std::vector<TGroupView>& groups, const int* const combination) {
+    for (int h = 0; h < L; ++h) {
+      mGroup[h] = &groups[combination[h]];
+      mMe[h] = mArena.values(combination[h]);
+      mMeMax[h] = mArena.meMax[combination[h]];
+    }
+    mBest = -FLT_MAX;
+    mPairs[0] = 0.0f;
+
+    const TGroupView& g = *mGroup[0];
+    mArena.order.clear();
+    for (size_t i = 0; i < g.size(); ++i) {
+      choose(0, i);
+      mArena.order.push_back(std::make_pair(bound(0), (int)i));
+    }
+    std::sort(mArena.order.begin(), mArena.order.end(), boundCompare);
+    for (size_t k = 0; k < mArena.order.size(); ++k) {
+      if (mArena.order[k].first <= mBest) {
+	mArena.pruned += (mArena.order.size() - k) * below(0);
+	break;
       }
+      choose(0, mArena.order[k].second);
+      gather(0);
+      descend(std::integral_constant<int, 1>());
     }
-    if (maxscore > -FLT_MAX) score += maxscore;
+    return mBest;
   }
-  return score;
-}
 
+ private:
+  // Choose the nodes of group J, 0 < J < L - 1, in turn.
+  template <int J>
+  void descend(std::integral_constant<int, J>) {
+    const TGroupView& g = *mGroup[J];
+    for (size_t i = 0; i < g.size(); ++i) {
+      choose(J, i);
+      if (bound(J) <= mBest) {
+	mArena.pruned += below(J);
+	continue;
+      }
+      gather(J);
+      descend(std::integral_constant<int, J + 1>());
+    }
+  }
 
-float score_complete5_clamped(const int score_node, const std::vector< std::vector<int> >& other_groups, const float* const similarities, const int width)
-{
-  const float* const me_base = similarities + (width * score_node);
-  std::vector< std::vector<int> > combinations;
-  comb(other_groups.size(), 4, combinations);
-  float score(0.0f);
-  
-  for (auto const& combination : combinations) {
-    float maxscore = -FLT_MAX;
-    const auto ig1 = combination[0];
-    const auto g1 = other_groups[ig1];
-    const auto ig2 = combination[1];
-    const auto g2 = other_groups[ig2];
-    const auto ig3 = combination[2];
-    const auto g3 = other_groups[ig3];
-    const auto ig4 = combination[3];
-    const auto g4 = other_groups[ig4];
-
-    for (const auto n1 : g1) {
-      const float me_n1 = me_base[n1];
-      const float* n1_base = similarities + (width * n1);
-      const float curr_outer(me_n1);
-      for (const auto n2 : g2) {
-	const float me_n2 = me_base[n2];
-	const float* n2_base = similarities + (width * n2);
-	// n1_n2
-	const float n1_n2 = n1_base[n2];
-	//float v(n1_n2);
-	//float vv(me_n1);
-	//MIN(v, vv, me_n2);
-	float curr_middle(curr_outer + me_n2 + n1_n2);
-	for (const auto n3 : g3) {
-	  const float me_n3 = me_base[n3];
-	  const float* n3_base = similarities + (width * n3);
-	  // n1_n3
-	  const float n1_n3 = n1_base[n3];
-	  //v = n1_n3;
-	  //vv = me_n1;
-	  //MIN(v, vv, me_n3);
-	  // n2_n3
-	  const float n2_n3 = n2_base[n3];
-	  //vv = n2_n3;
-	  //float vvv(me_n2);
-	  //MIN(vv, vvv, me_n3);
-	  
-	  const float curr_middle2(curr_middle + me_n3 + n1_n3 + n2_n3);
-	  
-	  for (const auto n4 : g4) {
-	    const float me_n4 = me_base[n4];
-	    float curr(curr_middle2 + me_n4);
-	    // n1_n4
-	    //v = n1_base[n4];
-	    //vv = me_n1;
-	    //MIN(v, vv, me_n4);
-	    //curr += v;
-	    curr += n1_base[n4];
-	    // n2_n4
-	    //v = n2_base[n4];
-	    //vv = me_n2;
-	    //MIN(v, vv, me_n4);
-	    //curr += v;
-	    curr += n2_base[4];
-	    // n3_n4
-	    //v = n2_base[n4];
-	    //vv = me_n3;
-	    //MIN(v, vv, me_n4);
-	    //curr += v;
-	    curr += n3_base[n4];
-	    
-	    maxscore = (curr > maxscore) ? curr : maxscore;
-	  }
+  // The last group, in one kernel call.
+  void descend(std::integral_constant<int, L - 1>) {
+    const float* c[L - 1];
+    for (int i = 0; i < L - 1; ++i) {
+      c[i] = mRows[i][L - 1];
+    }
+    const float curr = Clamp
+      ? mKernels.maxSetClamped[L - 1](mSum[L - 2], mMeNode, mMe[L - 1], c, mGroup[L - 1]->size())
+      : mKernels.maxSet[L - 1](mSum[L - 2], mPairs[L - 2], mMe[L - 1], c, mGroup[L - 1]->size());
+    mArena.evaluated++;
+    mBest = (curr > mBest) ? curr : mBest;
+  }
+
+  // Node i of group j, extending the sums of the nodes before it.
+  void choose(const int j, const size_t i) {
+    const float me = mMe[j][i];
+    mPos[j] = i;
+    mMeNode[j] = me;
+    float sum = (j == 0) ? me : mSum[j - 1] + me;
+    if (Clamp) {
+      for (int a = 0; a < j; ++a) {
+	sum += clampf(pair(a, j), mMeNode[a], me);
+      }
+    } else if (j > 0) {
+      float pairs = (j == 1) ? pair(0, 1) : mPairs[j - 1] + pair(0, j);
+      for (int a = 1; a < j; ++a) {
+	pairs += pair(a, j);
+      }
+      mPairs[j] = pairs;
+    }
+    mSum[j] = sum;
+  }
+
+  // The chosen node of group j's similarities to each later group.
+  void gather(const int j) {
+    const int n = (*mGroup[j])[mPos[j]];
+    for (int h = j + 1; h < L; ++h) {
+      gather_group(n, mSimilarities, *mGroup[h], mRows[j][h]);
+    }
+  }
+
+  // Similarity between the chosen nodes of groups a < b.
+  float pair(const int a, const int b) const { return mRows[a][b][mPos[b]]; }
+
+  // Upper bounds on the similarity between the nodes of groups a < h, and
+  // on me's to the node of group a, given the nodes chosen in groups 0..j.
+  float pairBound(const int a, const int h, const int j) const {
+    return (a <= j) ? mBounds.node(mGroup[a]->id, mPos[a], mGroup[h]->id) : mBounds.pair(mGroup[a]->id, mGroup[h]->id);
+  }
+  float meBound(const int a, const int j) const { return (a <= j) ? mMeNode[a] : mMeMax[a]; }
+
+  // An upper bound on every clique through the nodes chosen in groups 0..j.
+  float bound(const int j) const {
+    float sum = mSum[j];
+    for (int h = j + 1; h < L - 1; ++h) {
+      sum += mMeMax[h];
+      if (Clamp) {
+	for (int a = 0; a < h; ++a) {
+	  sum += clampf(pairBound(a, h, j), meBound(a, j), mMeMax[h]);
+	}
+      }
+    }
+    sum += mMeMax[L - 1];
+    if (!Clamp && L > 2) {
+      float pairs = mPairs[j];
+      for (int h = std::max(j + 1, 1); h < L - 1; ++h) {
+	for (int a = 0; a < h; ++a) {
+	  pairs = (h == 1) ? pairBound(0, 1, j) : pairs + pairBound(a, h, j);
 	}
       }
+      sum += pairs;
     }
+    for (int a = 0; a < L - 1; ++a) {
+      sum += Clamp ? clampf(pairBound(a, L - 1, j), meBound(a, j), mMeMax[L - 1]) : pairBound(a, L - 1, j);
+    }
+    return sum;
+  }
+
+  // Kernel calls below a node of group j.
+  uint64_t below(const int j) const {
+    uint64_t calls(1);
+    for (int h = j + 1; h < L - 1; ++h) {
+      calls *= mGroup[h]->size();
+    }
+    return calls;
+  }
+
+  const M& mSimilarities;
+  const TGroupBounds& mBounds;
+  TScoreArena& mArena;
+  const TScoreKernels& mKernels;
+  const TGroupView* mGroup[L];
+  const float* mMe[L];
+  float mMeMax[L];
+  // The chosen nodes: position in their group, me's similarity to them, the
+  // sum of me's similarities (clamped: with the pairs) and the sum of the
+  // pairs so far.
+  size_t mPos[L];
+  float mMeNode[L];
+  float mSum[L];
+  float mPairs[L];
+  float* mRows[L][L];
+  float mBest;
+};
+
+// The candidate's score: the sum, over every combination of K - 1 of the
+// other groups, of the best clique of the candidate and one node from each.
+template <int K, bool Clamp, typename M>
+float score_complete(const int score_node, const std::vector<TGroupView>& other_groups, const M& similarities,
+		     const TGroupBounds& bounds, TScoreArena& arena)
+{
+  group_similarities(score_node, similarities, other_groups, arena);
+  TCliqueSearch<K, Clamp, M> search(similarities, bounds, arena);
+  float score(0.0f);
+
+  int combination[K - 1];
+  for (bool more = firstCombination(other_groups.size(), K - 1, combination); more;
+       more = nextCombination(other_groups.size(), K - 1, combination)) {
+    const float maxscore = search.best(other_groups, combination);
     if (maxscore > -FLT_MAX) score += maxscore;
   }
-  
   return score;
 }
 
-
-void maximum_similarities_in_each_group(const int me, const float* const similarities, const int width, const std::vector< std::vector<int> >& other_groups, std::map<int, float>& max_values)
+template <typename M>
+float score_complete(const int setSize, const bool clamp, const int score_node, const std::vector<TGroupView>& other_groups,
+		     const M& similarities, const TGroupBounds& bounds, TScoreArena& arena)
 {
-  const float* base_sim(similarities + (width * me));
-  for (int i = 0; i < other_groups.size(); ++i) {
-    const auto other_group = other_groups[i];
-    float mx(-FLT_MAX);
-    for (const auto other_node : other_group) {
-      const float v(*(base_sim + other_node));
-      mx = (v > mx) ? v : mx;
-    }
-    max_values[i] = mx;
+  switch (setSize) {
+  case 3:
+    return clamp ? score_complete<3, true>(score_node, other_groups, similarities, bounds, arena)
+      : score_complete<3, false>(score_node, other_groups, similarities, bounds, arena);
+  case 4:
+    return clamp ? score_complete<4, true>(score_node, other_groups, similarities, bounds, arena)
+      : score_complete<4, false>(score_node, other_groups, similarities, bounds, arena);
+  case 5:
+    return clamp ? score_complete<5, true>(score_node, other_groups, similarities, bounds, arena)
+      : score_complete<5, false>(score_node, other_groups, similarities, bounds, arena);
+  case 6:
+    return clamp ? score_complete<6, true>(score_node, other_groups, similarities, bounds, arena)
+      : score_complete<6, false>(score_node, other_groups, similarities, bounds, arena);
+  case 7:
+    return clamp ? score_complete<7, true>(score_node, other_groups, similarities, bounds, arena)
+      : score_complete<7, false>(score_node, other_groups, similarities, bounds, arena);
+  case 8:
+  default:
+    return clamp ? score_complete<8, true>(score_node, other_groups, similarities, bounds, arena)
+      : score_complete<8, false>(score_node, other_groups, similarities, bounds, arena);
   }
 }
 
-void top_groups_for_candidate(const int candidate, const float* const similarities, const int width, const std::vector< std::vector<int> >& other_groups, const int num_groups_to_consider, std::vector< std::vector<int> >& top_groups)
+// The num_groups_to_consider groups holding the nodes most similar to the
+// candidate, best first, into arena.top.
+template <typename M>
+void top_groups_for_candidate(const int candidate, const M& similarities, const std::vector<TGroupView>& other_groups, const int num_groups_to_consider, TScoreArena& arena)
 {
-  std::map<int, float> max_values;
-  maximum_similarities_in_each_group(candidate, similarities, width, other_groups, max_values);
-  std::vector<std::pair<int, float> > pairs;
-  sortMapByVal(max_values, pairs, scoreCompare);
-  const int num_groups = std::min({(int)(pairs.size()), num_groups_to_consider});
+  group_similarities(candidate, similarities, other_groups, arena);
+  arena.maxima.clear();
+  for (size_t i = 0; i < other_groups.size(); ++i) {
+    float mx(-FLT_MAX);
+    for (size_t k = arena.meStart[i]; k < arena.meStart[i + 1]; ++k) {
+      mx = (arena.me[k] > mx) ? arena.me[k] : mx;
+    }
+    arena.maxima.push_back(std::make_pair((int)i, mx));
+  }
+  std::sort(arena.maxima.begin(), arena.maxima.end(), scoreCompare);
+  const int num_groups = std::min({(int)(arena.maxima.size()), num_groups_to_consider});
+  arena.top.clear();
   for (int i = 0; i < num_groups; ++i) {
-    top_groups.push_back(other_groups[pairs[i].first]);
+    arena.top.push_back(other_groups[arena.maxima[i].first]);
   }
 }
 
-#define NUMGROUPSTOCONSIDER3 250
-#define NUMGROUPSTOCONSIDER4 30
-#define NUMGROUPSTOCONSIDER5 30
+// How many of each candidate's strongest groups are searched, by clique
+// size; the number of combinations grows quickly with it.
+static const int kGroupsToConsider[kMaxSetSize + 1] = { 0, 0, 0, 250, 30, 30, 20, 15, 12 };
 
-bool CompleteGraphFasterScorer::ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+bool CompleteGraphFasterScorer::ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+{
+  return dispatchScoreModule(*this, similarities, groups, indicesToScore, scores);
+}
+
+template <typename M>
+bool CompleteGraphFasterScorer::Score(const M& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
 {
   // For each group, g_score, to score
   //  For each node, n_score, in g_score
   //   Figure out N best other groups, g_others, among all_groups - g_score
   //
-  std::vector< std::vector<int> > all_groups;
+  std::vector<TGroupView> all_groups;
   for (const auto& g : groups) {
-    all_groups.push_back(g.second);
+    all_groups.push_back(TGroupView{g.second.data(), g.second.size(), (int)all_groups.size()});
   }
-  
-  for (const auto& g : groups) {
-    const auto my_group = g.second;
-    std::vector< std::vector<int> > others(all_groups);
-    auto it = std::find(others.begin(), others.end(), my_group);
-    others.erase(it);
-    //printf("group %s\n", g.first.c_str());
-    for (const auto me : my_group) {
-      // Find the strongest hits in each locus
-      std::vector< std::vector<int> > top_groups;
-      if (this->mScoreSize ==  3 || groups.size() < 4) {
-	top_groups_for_candidate(me, similarities, width, others, NUMGROUPSTOCONSIDER3, top_groups);
-	if (mClamp) {
-	  scores[me] = score_complete3_clamped(me, top_groups, similarities, width);
-	} else {
-	  scores[me] = score_complete3(me, top_groups, similarities, width);
-	}
-      }
-      else if (this->mScoreSize == 4 or groups.size() < 5) {
-	top_groups_for_candidate(me, similarities, width, others, NUMGROUPSTOCONSIDER4, top_groups);
-	if (mClamp) {
-	  scores[me] = score_complete4_clamped(me, top_groups, similarities, width);
-	} else {
-	  scores[me] = score_complete4(me, top_groups, similarities, width);
-	}
-      }
-      else {
-	top_groups_for_candidate(me, similarities, width, others, NUMGROUPSTOCONSIDER5, top_groups);
-	if (mClamp) {
-	  scores[me] = score_complete5_clamped(me, top_groups, similarities, width);
-	} else {
-	  scores[me] = score_complete5(me, top_groups, similarities, width);
-	}
-      }
+
+  // Every candidate is scored on its own, so they are handed out to the
+  // thread pool one at a time. Each writes only its slot of a dense result
+  // buffer, copied into scores once they are all done. The other groups of
+  // each group are views, listed once per group rather than per candidate.
+  std::vector< std::vector<TGroupView> > others_by_group;
+  std::vector<int> candidates, candidate_group;
+  for (size_t ig = 0; ig < all_groups.size(); ++ig) {
+    std::vector<TGroupView> others(all_groups);
+    others.erase(others.begin() + ig);
+    for (size_t i = 0; i < all_groups[ig].size(); ++i) {
+      candidates.push_back(all_groups[ig][i]);
+      candidate_group.push_back(ig);
     }
+    others_by_group.push_back(others);
+  }
+
+  // Modules with fewer groups than the clique size are scored with cliques
+  // of every group.
+  const int setSize = std::max(3, std::min(mScoreSize, (int)groups.size()));
+  TGroupBounds bounds;
+  group_bounds(similarities, all_groups, *mPool, bounds);
+  std::vector<float> results(candidates.size());
+  std::vector<TScoreArena> arenas(mPool->numThreads());
+  mPool->run(candidates.size(), [&](size_t c, int thread) {
+      const int me = candidates[c];
+      const auto& others = others_by_group[candidate_group[c]];
+      TScoreArena& arena = arenas[thread];
+      // Find the strongest hits in each locus
+      top_groups_for_candidate(me, similarities, others, kGroupsToConsider[setSize], arena);
+      results[c] = score_complete(setSize, mClamp, me, arena.top, similarities, bounds, arena);
+    });
+  for (size_t c = 0; c < candidates.size(); ++c) {
+    scores[candidates[c]] = results[c];
+  }
+  for (auto const& arena : arenas) {
+    mEvaluated += arena.evaluated;
+    mPruned += arena.pruned;
   }
   return true;
 }
@@ -719,12 +777,19 @@ void randomize_matrix(float* const similarities, const int width, const int numS
 }
 
 
-bool PValCompleteScorer::ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+bool PValCompleteScorer::ScoreModule(const SimilarityMatrix& similarityMatrix, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
 {
+  // Edge shuffling works on a private dense copy of the matrix.
+  if (similarityMatrix.layout() != kDenseLayout) {
+    printf("Matrix permutation scoring needs a dense similarity matrix.\n");
+    return false;
+  }
+  const float* const similarities = static_cast<const DenseSimilarities&>(similarityMatrix).data();
+  const int width = similarityMatrix.width();
   CompleteGraphFasterScorer scorer(3);
 
   TScoreMap myscores;
-  scorer.ScoreModule(similarities, width, groups, indicesToScore, myscores);
+  scorer.ScoreModule(similarityMatrix, groups, indicesToScore, myscores);
 
   // Copy matrix
   const int numBytes(sizeof(float) * width * width);
@@ -746,7 +811,7 @@ bool PValCompleteScorer::ScoreModule(const float* const similarities, const int
     printf("iteration %i\n", i);
     randomize_matrix(scratch, width, (width * width) / 2);
     TScoreMap permuted_scores;
-    scorer.ScoreModule(scratch, width, groups, indicesToScore, permuted_scores);
+    scorer.ScoreModule(DenseSimilarities(scratch, width), groups, indicesToScore, permuted_scores);
     for (const auto &score : permuted_scores) {
       scoresMap[score.first].push_back(score.second);
     }
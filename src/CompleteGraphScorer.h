@@ -10,6 +10,9 @@
 ** -------------------------------------------------------------------------*/
 
 #include "../include/IModuleScorer.h"
+#include "ThreadPool.h"
+#include <memory>
+#include <stdint.h>
 
 /* class CompleteGraphScorer : public IModuleScorer { */
 /* public: */
@@ -33,24 +36,40 @@
 
 class BaseScorer: public IModuleScorer {
  public:
-  void BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::ostream& out) const;
-  void LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TIndicesGroups& groups, std::ostream& out) const;
+  void BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const;
+  void LongSummary(TScoreMap& scores, const GeneDictionary& genes, const TIndicesGroups& groups, std::ostream& out) const;
 };
 
 
 class CompleteGraphFasterScorer : public BaseScorer {
  public:
- CompleteGraphFasterScorer(const int scoreSize, const bool clamp = false): mScoreSize(scoreSize), mClamp(clamp) {}
-  bool ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups,
+  // scoreSize is the number of nodes in each clique, the candidate
+  // included, from 3 to kMaxSetSize (ScoreKernels.h). Candidates are scored
+  // in parallel on numThreads threads (0: every core).
+ CompleteGraphFasterScorer(const int scoreSize, const bool clamp = false, const int numThreads = 0)
+   : mScoreSize(scoreSize), mClamp(clamp), mPool(new ThreadPool(numThreads)), mEvaluated(0), mPruned(0) {}
+  bool ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups,
 		   const TIndices& indicestoScore, TScoreMap& scores) const;
+  template <typename M>
+  bool Score(const M& similarities, const TIndicesGroups& groups,
+	     const TIndices& indicestoScore, TScoreMap& scores) const;
+  // Also reports how much of the search branch and bound cut.
+  void BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const;
+  // Partial cliques scored, and those skipped because their bound could not
+  // beat the best so far, over every module scored.
+  uint64_t numEvaluated(void) const { return mEvaluated; }
+  uint64_t numPruned(void) const { return mPruned; }
  private:
   int mScoreSize;
   bool mClamp;
+  std::shared_ptr<ThreadPool> mPool;
+  mutable uint64_t mEvaluated;
+  mutable uint64_t mPruned;
 };
 
 class PValCompleteScorer : public BaseScorer {
  public:
   PValCompleteScorer() {}
-  bool ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups,
+  bool ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups,
 		   const TIndices& indicestoScore, TScoreMap& scores) const;
 };
@@ -0,0 +1,241 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** CompressedStream.cpp
+** This file implements the decompressing matrix input streams.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "CompressedStream.h"
+#include <cstring>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Compressed input is read, and decompressed output handed over, in blocks
+// of these sizes. At most MAX_QUEUED_BLOCKS wait for the reader.
+#define COMPRESSED_READ_SIZE (256 * 1024)
+#define DECOMPRESSED_BLOCK_SIZE (1024 * 1024)
+#define MAX_QUEUED_BLOCKS 8
+
+TCompression detectCompression(const std::string& filename) {
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (f == 0) {
+    return kUncompressed;
+  }
+  unsigned char magic[4];
+  const size_t n = fread(magic, 1, sizeof(magic), f);
+  fclose(f);
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return kGzip;
+  }
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+    return kZstd;
+  }
+  return kUncompressed;
+}
+
+DecompressingBuffer::DecompressingBuffer(void)
+  : mFile(0), mCompression(kUncompressed), mDone(true), mClosing(false) {
+}
+
+DecompressingBuffer::~DecompressingBuffer(void) {
+  close();
+}
+
+bool DecompressingBuffer::open(const std::string& filename, const TCompression compression) {
+  close();
+#ifndef HAVE_ZSTD
+  if (compression == kZstd) {
+    printf("%s is zstd compressed, but this build has no zstd support.\n", filename.c_str());
+    return false;
+  }
+#endif
+  mFile = fopen(filename.c_str(), "rb");
+  if (mFile == 0) {
+    return false;
+  }
+  mFilename = filename;
+  mCompression = compression;
+  mDone = false;
+  mClosing = false;
+  mCurrent.clear();
+  setg(0, 0, 0);
+  mProducer = std::thread(&DecompressingBuffer::produce, this);
+  return true;
+}
+
+void DecompressingBuffer::close(void) {
+  if (mProducer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mClosing = true;
+    }
+    mChanged.notify_all();
+    mProducer.join();
+  }
+  if (mFile != 0) {
+    fclose(mFile);
+    mFile = 0;
+  }
+  mBlocks.clear();
+  mCurrent.clear();
+  setg(0, 0, 0);
+  mDone = true;
+}
+
+DecompressingBuffer::int_type DecompressingBuffer::underflow(void) {
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (mBlocks.empty() && !mDone) {
+    mChanged.wait(lock);
+  }
+  if (mBlocks.empty()) {
+    return traits_type::eof();
+  }
+  mCurrent.swap(mBlocks.front());
+  mBlocks.pop_front();
+  lock.unlock();
+  mChanged.notify_all();
+  char* const begin = &mCurrent[0];
+  setg(begin, begin, begin + mCurrent.size());
+  return traits_type::to_int_type(*gptr());
+}
+
+bool DecompressingBuffer::push(std::vector<char>& block) {
+  if (block.empty()) {
+    return true;
+  }
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (mBlocks.size() >= MAX_QUEUED_BLOCKS && !mClosing) {
+    mChanged.wait(lock);
+  }
+  if (mClosing) {
+    return false;
+  }
+  mBlocks.push_back(std::vector<char>());
+  mBlocks.back().swap(block);
+  lock.unlock();
+  mChanged.notify_all();
+  block.reserve(DECOMPRESSED_BLOCK_SIZE);
+  return true;
+}
+
+void DecompressingBuffer::produce(void) {
+  const bool ok = (mCompression == kGzip) ? inflateGzip() : decompressZstd();
+  if (!ok) {
+    printf("Problem decompressing %s; the matrix is truncated.\n", mFilename.c_str());
+  }
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDone = true;
+  }
+  mChanged.notify_all();
+}
+
+bool DecompressingBuffer::inflateGzip(void) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // 32 lets zlib detect the gzip header.
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+    return false;
+  }
+  std::vector<unsigned char> in(COMPRESSED_READ_SIZE);
+  std::vector<char> block;
+  bool ok(true), finished(false), full(false);
+  while (ok) {
+    // A full output block may leave output pending inside zlib.
+    if (zs.avail_in == 0 && !full) {
+      zs.next_in = &in[0];
+      zs.avail_in = fread(&in[0], 1, in.size(), mFile);
+      if (zs.avail_in == 0) {
+	// A stream that stops mid-member is an error.
+	ok = finished && !ferror(mFile);
+	break;
+      }
+    }
+    block.resize(DECOMPRESSED_BLOCK_SIZE);
+    zs.next_out = (Bytef*)&block[0];
+    zs.avail_out = block.size();
+    const int status = inflate(&zs, Z_NO_FLUSH);
+    full = (zs.avail_out == 0);
+    block.resize(block.size() - zs.avail_out);
+    if (status == Z_STREAM_END) {
+      // Concatenated gzip members are read as one file.
+      finished = true;
+      full = false;
+      inflateReset(&zs);
+    } else if (status == Z_OK) {
+      finished = false;
+    } else if (status != Z_BUF_ERROR) {
+      ok = false;
+    }
+    if (!push(block)) {
+      break;
+    }
+  }
+  inflateEnd(&zs);
+  return ok;
+}
+
+bool DecompressingBuffer::decompressZstd(void) {
+#ifdef HAVE_ZSTD
+  ZSTD_DStream* const ds = ZSTD_createDStream();
+  if (ds == 0 || ZSTD_isError(ZSTD_initDStream(ds))) {
+    ZSTD_freeDStream(ds);
+    return false;
+  }
+  std::vector<char> in(COMPRESSED_READ_SIZE);
+  std::vector<char> block;
+  size_t status(0);
+  bool ok(true);
+  while (ok) {
+    ZSTD_inBuffer input = { &in[0], fread(&in[0], 1, in.size(), mFile), 0 };
+    if (input.size == 0) {
+      // Zero once the last frame is complete.
+      ok = (status == 0) && !ferror(mFile);
+      break;
+    }
+    // Keep going while a full output block may leave data in the decoder.
+    bool full(false);
+    while (ok && (input.pos < input.size || full)) {
+      block.resize(DECOMPRESSED_BLOCK_SIZE);
+      ZSTD_outBuffer output = { &block[0], block.size(), 0 };
+      status = ZSTD_decompressStream(ds, &output, &input);
+      full = (output.pos == output.size);
+      block.resize(output.pos);
+      if (ZSTD_isError(status)) {
+	ok = false;
+      } else if (!push(block)) {
+	ZSTD_freeDStream(ds);
+	return true;
+      }
+    }
+  }
+  ZSTD_freeDStream(ds);
+  return ok;
+#else
+  return false;
+#endif
+}
+
+MatrixInputStream::MatrixInputStream(const std::string& filename)
+  : std::istream(0), mCompression(detectCompression(filename)) {
+  if (compressed()) {
+    if (mDecompressor.open(filename, mCompression)) {
+      rdbuf(&mDecompressor);
+    } else {
+      setstate(std::ios::failbit);
+    }
+  } else if (mFile.open(filename.c_str(), std::ios::in)) {
+    rdbuf(&mFile);
+  } else {
+    setstate(std::ios::failbit);
+  }
+}
@@ -0,0 +1,88 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** CompressedStream.h
+** Input streams over plain, gzip or zstd compressed matrix files.
+**
+** Compressed files are recognized by their magic bytes. A producer thread
+** decompresses into a short queue of blocks while the reading thread parses
+** the blocks already handed over, so decompression overlaps with parsing.
+** zstd support is only built when configure finds zstd.h.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef COMPRESSEDSTREAM_H
+#define COMPRESSEDSTREAM_H
+
+#include <istream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+
+enum TCompression {
+  kUncompressed,
+  kGzip,
+  kZstd
+};
+
+TCompression detectCompression(const std::string& filename);
+
+// Read-only streambuf fed by a decompressing producer thread. It cannot seek,
+// so tellg() on a stream over it reports -1.
+class DecompressingBuffer : public std::streambuf {
+ public:
+  DecompressingBuffer(void);
+  ~DecompressingBuffer(void);
+
+  bool open(const std::string& filename, const TCompression compression);
+  void close(void);
+
+ protected:
+  int_type underflow(void);
+
+ private:
+  DecompressingBuffer(const DecompressingBuffer&);
+  DecompressingBuffer& operator=(const DecompressingBuffer&);
+
+  void produce(void);
+  bool inflateGzip(void);
+  bool decompressZstd(void);
+  // Hand a full block to the reader, waiting while the queue is full.
+  // Returns false once the reader has gone away.
+  bool push(std::vector<char>& block);
+
+  FILE* mFile;
+  std::string mFilename;
+  TCompression mCompression;
+  std::thread mProducer;
+  std::mutex mMutex;
+  std::condition_variable mChanged;
+  std::deque<std::vector<char> > mBlocks;
+  std::vector<char> mCurrent;
+  bool mDone;
+  bool mClosing;
+};
+
+// Opens a matrix file, decompressing it on the fly when needed. Plain files
+// keep a seekable std::filebuf so they can still be memory mapped by offset.
+class MatrixInputStream : public std::istream {
+ public:
+  explicit MatrixInputStream(const std::string& filename);
+
+  bool compressed(void) const { return mCompression != kUncompressed; }
+
+ private:
+  TCompression mCompression;
+  std::filebuf mFile;
+  DecompressingBuffer mDecompressor;
+};
+
+#endif
@@ -0,0 +1,177 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** EdgeList.cpp
+** This file implements the edge list reader and the sparse adjacency.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "EdgeList.h"
+#include <algorithm>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static bool lowerPair(const TEdge& a, const TEdge& b) {
+  const int a1 = std::min(a.from, a.to), b1 = std::min(b.from, b.to);
+  if (a1 != b1) {
+    return a1 < b1;
+  }
+  return std::max(a.from, a.to) < std::max(b.from, b.to);
+}
+
+static bool samePair(const TEdge& a, const TEdge& b) {
+  return !lowerPair(a, b) && !lowerPair(b, a);
+}
+
+// Split one line into the first three tab-delimited fields.
+static bool parseEdge(const char* p, const char* const end, GeneDictionary& genes, TEdge& edge) {
+  const char* fields[3];
+  size_t lengths[3];
+  for (int f = 0; f < 3; ++f) {
+    const char* tab = (const char*)memchr(p, '\t', end - p);
+    const char* fieldEnd = (tab == 0) ? end : tab;
+    if (f < 2 && tab == 0) {
+      return false;
+    }
+    fields[f] = p;
+    lengths[f] = fieldEnd - p;
+    p = (tab == 0) ? end : tab + 1;
+  }
+  if (lengths[2] == 0) {
+    return false;
+  }
+  edge.from = genes.intern(fields[0], lengths[0]);
+  edge.to = genes.intern(fields[1], lengths[1]);
+  // The weight field ends at a tab or the end of the line, neither of which
+  // strtof reads past; copy it so it is terminated.
+  char weight[64];
+  const size_t n = std::min(lengths[2], sizeof(weight) - 1);
+  memcpy(weight, fields[2], n);
+  weight[n] = '\0';
+  edge.weight = strtof(weight, 0);
+  return true;
+}
+
+bool readEdgeList(std::istream& in, GeneDictionary& genes, std::vector<TEdge>& edges) {
+  // Read in large blocks and cut lines out of them; a line cut by the end of
+  // a block is carried over to the front of the next.
+  const size_t blockSize = 1 << 20;
+  std::vector<char> buffer(blockSize);
+  size_t carried = 0;
+  size_t lineNumber = 0;
+  bool done(false);
+  while (!done) {
+    if (carried == buffer.size()) {
+      buffer.resize(2 * buffer.size());
+    }
+    in.read(&buffer[carried], buffer.size() - carried);
+    const size_t filled = carried + in.gcount();
+    done = (in.gcount() == 0);
+
+    const char* p = &buffer[0];
+    const char* const end = p + filled;
+    while (p < end) {
+      const char* nl = (const char*)memchr(p, '\n', end - p);
+      if (nl == 0 && !done) {
+	break;
+      }
+      const char* lineEnd = (nl == 0) ? end : nl;
+      lineNumber++;
+      if (lineEnd > p && lineEnd[-1] == '\r') {
+	lineEnd--;
+      }
+      if (lineEnd > p) {
+	TEdge edge;
+	if (!parseEdge(p, lineEnd, genes, edge)) {
+	  printf("Malformed edge on line %lu.\n", (unsigned long)lineNumber);
+	  return false;
+	}
+	edges.push_back(edge);
+      }
+      p = (nl == 0) ? end : nl + 1;
+    }
+    carried = end - p;
+    memmove(&buffer[0], p, carried);
+  }
+  return !in.bad();
+}
+
+void uniqueEdges(std::vector<TEdge>& edges, int numThreads) {
+  if (numThreads <= 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  const size_t minChunk = 1 << 16;
+  if ((size_t)numThreads > edges.size() / minChunk + 1) {
+    numThreads = edges.size() / minChunk + 1;
+  }
+
+  // Stable sort chunks in parallel, then merge neighbours pairwise; both
+  // steps keep equal pairs in the order they were read.
+  std::vector<size_t> bounds(numThreads + 1);
+  for (int t = 0; t <= numThreads; ++t) {
+    bounds[t] = edges.size() * t / numThreads;
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    threads.push_back(std::thread([&, t]() {
+	  std::stable_sort(edges.begin() + bounds[t], edges.begin() + bounds[t + 1], lowerPair);
+	}));
+  }
+  for (auto &th : threads) th.join();
+  for (size_t width = 1; width < (size_t)numThreads; width *= 2) {
+    threads.clear();
+    for (size_t t = 0; t + width < (size_t)numThreads; t += 2 * width) {
+      const size_t last = std::min(t + 2 * width, (size_t)numThreads);
+      threads.push_back(std::thread([&, t, width, last]() {
+	    std::inplace_merge(edges.begin() + bounds[t], edges.begin() + bounds[t + width],
+			       edges.begin() + bounds[last], lowerPair);
+	  }));
+    }
+    for (auto &th : threads) th.join();
+  }
+
+  // Keep the last of each run of equal pairs.
+  size_t kept = 0;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    if (i + 1 < edges.size() && samePair(edges[i], edges[i + 1])) {
+      continue;
+    }
+    edges[kept++] = edges[i];
+  }
+  edges.resize(kept);
+  std::vector<TEdge>(edges).swap(edges);
+}
+
+void NetworkAdjacency::assign(const int numNodes, const std::vector<TEdge>& edges) {
+  mRowStart.assign(numNodes + 1, 0);
+  for (auto const &e : edges) {
+    mRowStart[e.from + 1]++;
+    if (e.to != e.from) {
+      mRowStart[e.to + 1]++;
+    }
+  }
+  for (int i = 0; i < numNodes; ++i) {
+    mRowStart[i + 1] += mRowStart[i];
+  }
+  mColumns.resize(mRowStart[numNodes]);
+  mWeights.resize(mRowStart[numNodes]);
+
+  // Edges are sorted by (lower id, higher id), so walking them in order
+  // fills every row with increasing columns: a row's lower neighbours come
+  // from earlier pairs than its higher ones.
+  std::vector<size_t> next(mRowStart.begin(), mRowStart.end() - 1);
+  for (auto const &e : edges) {
+    const int lo = std::min(e.from, e.to), hi = std::max(e.from, e.to);
+    mColumns[next[lo]] = hi;
+    mWeights[next[lo]++] = e.weight;
+    if (hi != lo) {
+      mColumns[next[hi]] = lo;
+      mWeights[next[hi]++] = e.weight;
+    }
+  }
+}
@@ -0,0 +1,63 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** EdgeList.h
+** Reads weighted edge lists (gene, gene, weight; tab delimited) and turns
+** them into a compressed sparse row adjacency.
+**
+** Gene names are interned as they are read, so ids follow the order in which
+** genes first appear. Edges are undirected: repeats of a pair, in either
+** orientation, collapse to the last one read.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef EDGELIST_H
+#define EDGELIST_H
+
+#include "../include/GeneDictionary.h"
+#include <istream>
+#include <vector>
+#include <cstddef>
+
+struct TEdge {
+  int from;
+  int to;
+  float weight;
+};
+
+// An undirected network in compressed sparse row form. Each edge is listed
+// in the rows of both its genes (a self-loop once), and every row's columns
+// are increasing.
+class NetworkAdjacency {
+ public:
+  NetworkAdjacency(void) : mRowStart(1, 0) {}
+
+  int numNodes(void) const { return (int)mRowStart.size() - 1; }
+  size_t numEntries(void) const { return mColumns.size(); }
+  size_t rowBegin(const int i) const { return mRowStart[i]; }
+  size_t rowEnd(const int i) const { return mRowStart[i + 1]; }
+  int column(const size_t k) const { return mColumns[k]; }
+  float weight(const size_t k) const { return mWeights[k]; }
+
+  // Build from edges already passed through uniqueEdges().
+  void assign(const int numNodes, const std::vector<TEdge>& edges);
+
+ private:
+  std::vector<size_t> mRowStart;
+  std::vector<int> mColumns;
+  std::vector<float> mWeights;
+};
+
+// Append the edges in the stream, interning gene names into genes. Blank
+// lines are skipped; a line without three fields is an error.
+bool readEdgeList(std::istream& in, GeneDictionary& genes, std::vector<TEdge>& edges);
+
+// Collapse repeated pairs to the last one read, leaving the edges sorted by
+// (lower id, higher id). The sort runs on numThreads threads (0: every
+// core).
+void uniqueEdges(std::vector<TEdge>& edges, int numThreads = 0);
+
+#endif
@@ -0,0 +1,28 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** FactorSimilarities.cpp
+** Dense blocks of a low-rank similarity factor.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "../include/SimilarityMatrix.h"
+#include "LapackRoutines.h"
+
+void FactorSimilarities::block(const std::vector<int>& indices, float* const out) const {
+  // The wanted rows of F side by side are a rank x k column-major matrix A,
+  // and the block is A^T A.
+  int k = indices.size();
+  int r = mRank;
+  std::vector<float> a((size_t)r * k);
+  for (int c = 0; c < k; ++c) {
+    const float* const row = mData + (size_t)r * indices[c];
+    std::copy(row, row + r, &a[(size_t)c * r]);
+  }
+  float one = 1.0f, zero = 0.0f;
+  char trans = 'T', notrans = 'N';
+  gemm(&trans, &notrans, &k, &k, &r, &one, &a[0], &a[0], &zero, out);
+}
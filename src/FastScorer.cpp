@@ -17,7 +17,13 @@
 
 typedef std::vector<int> TInts;
 
-bool FastScorer::ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+bool FastScorer::ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+{
+  return dispatchScoreModule(*this, similarities, groups, indicesToScore, scores);
+}
+
+template <typename M>
+bool FastScorer::Score(const M& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
 {
   // For each group, g
   //   For each node in g, n
@@ -62,11 +68,12 @@ bool FastScorer::ScoreModule(const float* const similarities, const int width, c
     }
   }
   
+  // me's similarities to one other group at a time
+  std::vector<float> values;
   for (auto const& group : goodGroups) {
     //for (int i = 0; i < group.size(); ++i) {
     //const auto me = group[i];
     for (auto const& me : group.second) {
-      const float* const sim = similarities + width * me;
       TIndicesGroups otherGroups(groups);
       auto it = std::find(otherGroups.begin(), otherGroups.end(), group);
       otherGroups.erase(it);
@@ -80,8 +87,14 @@ bool FastScorer::ScoreModule(const float* const similarities, const int width, c
   	//for (const auto j : othergroup) {
 	//for (int j = 0; j < othergroup.size(); ++j) {
 	//const int ot = othergroup[j];
-	for (const auto& ot : othergroup.second) {
-  	  const float sc = sim[ot];
+	const TIndices& others = othergroup.second;
+	values.resize(others.size());
+	if (!others.empty()) {
+	  gatherSimilarities(similarities, me, &others[0], others.size(), &values[0]);
+	}
+	for (size_t j = 0; j < others.size(); ++j) {
+  	  const int ot = others[j];
+  	  const float sc = values[j];
 	  //maxnode = (sc > maxscore) ? ot : maxnode;
 	  //maxscore = (sc > maxscore) ? sc : maxscore;
   	  if (sc > maxscore) {
@@ -99,12 +112,11 @@ bool FastScorer::ScoreModule(const float* const similarities, const int width, c
       const int* cindexBuffer = indexBuffer;
       for (int ii = 0; ii < endloop; ++ii) {
       	const int iii = cindexBuffer[ii];
-      	const float* base_iii = similarities + width * iii;
-	const float me_iii(sim[iii]);
+	const float me_iii(similarities(me, iii));
       	for (int jj = ii + 1; jj < endloop; ++jj) {
       	  const int jjj = cindexBuffer[jj];
-	  const float me_jjj(sim[jjj]);
-      	  const float iii_jjj(base_iii[jjj]);
+	  const float me_jjj(similarities(me, jjj));
+      	  const float iii_jjj(similarities(iii, jjj));
 	  float val = (iii_jjj < me_iii) ? iii_jjj : me_iii;
 	  val = (val < me_jjj) ? val : me_jjj;
 	  //float val(MIN(iii_jjj, MIN(me_iii, me_jjj)));
@@ -128,7 +140,7 @@ bool scoreCompare2(const std::pair<int, float>& firstElem, const std::pair<int,
   return firstElem.second > secondElem.second;
 }
 
-void FastScorer::BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::ostream& out) const {
+void FastScorer::BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const {
   
   std::vector<std::pair<int, float> > pairs;
   sortMapByVal(scores, pairs, scoreCompare2);
@@ -136,11 +148,11 @@ void FastScorer::BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::os
   out << std::endl << "Top 10 genes" << std::endl << "Gene\tScore" << std::endl << "----------------" << std::endl;
   int i = 0;
   for (auto it = pairs.begin(); it != pairs.end() && i < 10; it++, i++) {
-    out << rmap[it->first] << "\t" << it->second << std::endl;
+    out << genes.name(it->first) << "\t" << it->second << std::endl;
   }
 }
 
-void FastScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TIndicesGroups& groups, std::ostream& out) const {
+void FastScorer::LongSummary(TScoreMap& scores, const GeneDictionary& genes, const TIndicesGroups& groups, std::ostream& out) const {
 
 #define OLD_FORMAT 0
 #if OLD_FORMAT
@@ -155,7 +167,7 @@ void FastScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TI
     std::vector<std::pair<int, float> > pairs;
     sortMapByVal(locusScores, pairs, scoreCompare);
     for (auto const &e : pairs) {
-      out << rmap[e.first] << "\t" << e.second << std::endl;
+      out << genes.name(e.first) << "\t" << e.second << std::endl;
     }
     l++;
   }
@@ -173,7 +185,7 @@ void FastScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TI
   sortMapByVal(scores, pairs, scoreCompare2);
   out << "locus\tgene\tscore" << std::endl;
   for (auto const &e : pairs) {
-    out << groupMap[e.first] << "\t" << rmap[e.first] << "\t" << scores[e.first] << std::endl;
+    out << groupMap[e.first] << "\t" << genes.name(e.first) << "\t" << scores[e.first] << std::endl;
   }
 #endif
 
@@ -197,7 +209,13 @@ void FastScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TI
 }
 
 
-bool SimpleScorer::ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+bool SimpleScorer::ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+{
+  return dispatchScoreModule(*this, similarities, groups, indicesToScore, scores);
+}
+
+template <typename M>
+bool SimpleScorer::Score(const M& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
 {
   TIndicesGroups goodGroups;
   for (auto const& group : groups) {
@@ -228,11 +246,12 @@ bool SimpleScorer::ScoreModule(const float* const similarities, const int width,
     }
   }
   
+  // me's similarities to one other group at a time
+  std::vector<float> values;
   for (auto const& group : goodGroups) {
     //for (int i = 0; i < group.size(); ++i) {
     //const auto me = group[i];
     for (auto const& me : group.second) {
-      const float* const sim = similarities + width * me;
       TIndicesGroups otherGroups(groups);
       auto it = std::find(otherGroups.begin(), otherGroups.end(), group);
       otherGroups.erase(it);
@@ -246,8 +265,14 @@ bool SimpleScorer::ScoreModule(const float* const similarities, const int width,
   	//for (const auto j : othergroup) {
 	//for (int j = 0; j < othergroup.size(); ++j) {
 	//const int ot = othergroup[j];
-	for (const auto& ot : othergroup.second) {
-  	  const float sc = sim[ot];
+	const TIndices& others = othergroup.second;
+	values.resize(others.size());
+	if (!others.empty()) {
+	  gatherSimilarities(similarities, me, &others[0], others.size(), &values[0]);
+	}
+	for (size_t j = 0; j < others.size(); ++j) {
+  	  const int ot = others[j];
+  	  const float sc = values[j];
 	  //maxnode = (sc > maxscore) ? ot : maxnode;
 	  //maxscore = (sc > maxscore) ? sc : maxscore;
   	  if (sc > maxscore) {
@@ -272,7 +297,13 @@ bool SimpleScorer::ScoreModule(const float* const similarities, const int width,
 
 
 
-bool SumScorer::ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+bool SumScorer::ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+{
+  return dispatchScoreModule(*this, similarities, groups, indicesToScore, scores);
+}
+
+template <typename M>
+bool SumScorer::Score(const M& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
 {
   TIndicesGroups goodGroups;
   for (auto const& group : groups) {
@@ -296,11 +327,12 @@ bool SumScorer::ScoreModule(const float* const similarities, const int width, co
     }
   }
   
+  // me's similarities to one other group at a time
+  std::vector<float> values;
   for (auto const& group : goodGroups) {
     //for (int i = 0; i < group.size(); ++i) {
     //const auto me = group[i];
     for (auto const& me : group.second) {
-      const float* const sim = similarities + width * me;
       TIndicesGroups otherGroups(groups);
       auto it = std::find(otherGroups.begin(), otherGroups.end(), group);
       otherGroups.erase(it);
@@ -316,8 +348,13 @@ bool SumScorer::ScoreModule(const float* const similarities, const int width, co
 	//for (int j = 0; j < othergroup.size(); ++j) {
 	//const int ot = othergroup[j];
 	float score = 0.0f;
-	for (const auto& ot : othergroup.second) {
-  	  const float sc = sim[ot];
+	const TIndices& others = othergroup.second;
+	values.resize(others.size());
+	if (!others.empty()) {
+	  gatherSimilarities(similarities, me, &others[0], others.size(), &values[0]);
+	}
+	for (size_t j = 0; j < others.size(); ++j) {
+  	  const float sc = values[j];
 	  score += (sc / othergroupsize);
 	}
 	scores[me] += score;
@@ -14,25 +14,34 @@
 class FastScorer : public IModuleScorer {
 public:
   FastScorer(void) {}
-  bool ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups,
+  bool ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups,
 		   const TIndices& indicesToScore, TScoreMap& scores) const;
-  void BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::ostream& out) const;
-  void LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TIndicesGroups& groups, std::ostream& out) const;
+  template <typename M>
+  bool Score(const M& similarities, const TIndicesGroups& groups,
+	     const TIndices& indicesToScore, TScoreMap& scores) const;
+  void BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const;
+  void LongSummary(TScoreMap& scores, const GeneDictionary& genes, const TIndicesGroups& groups, std::ostream& out) const;
 };
 
 
 class SimpleScorer : public FastScorer {
  public:
   SimpleScorer(void) {}
-  bool ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups,
+  bool ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups,
 		   const TIndices& indicesToScore, TScoreMap& scores) const;
+  template <typename M>
+  bool Score(const M& similarities, const TIndicesGroups& groups,
+	     const TIndices& indicesToScore, TScoreMap& scores) const;
   
 };
 
 class SumScorer : public FastScorer {
  public:
   SumScorer(void) {}
-  bool ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups,
+  bool ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups,
 		   const TIndices& indicesToScore, TScoreMap& scores) const;
+  template <typename M>
+  bool Score(const M& similarities, const TIndicesGroups& groups,
+	     const TIndices& indicesToScore, TScoreMap& scores) const;
   
 };
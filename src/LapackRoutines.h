@@ -0,0 +1,150 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** LapackRoutines.h
+** Declarations of the LAPACK and BLAS routines used to build graph kernels,
+** with overloads that pick the single or double precision routine from the
+** argument types.
+**
+** Matrices are column-major and packed: leading dimensions are taken from
+** the matrix sizes.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef LAPACKROUTINES_H
+#define LAPACKROUTINES_H
+
+extern "C" {
+    // LU decomoposition of a general matrix
+    void sgetrf_(int* M, int *N, float* A, int* lda, int* IPIV, int* INFO);
+    void dgetrf_(int* M, int *N, double* A, int* lda, int* IPIV, int* INFO);
+
+    // generate inverse of a matrix given its LU decomposition
+    void sgetri_(int* N, float* A, int* lda, int* IPIV, float* WORK, int* lwork, int* INFO);
+    void dgetri_(int* N, double* A, int* lda, int* IPIV, double* WORK, int* lwork, int* INFO);
+
+    // solve A X = B given the LU decomposition of A
+    void sgetrs_(char* TRANS, int* N, int* NRHS, float* A, int* lda, int* IPIV, float* B, int* ldb, int* INFO);
+    void dgetrs_(char* TRANS, int* N, int* NRHS, double* A, int* lda, int* IPIV, double* B, int* ldb, int* INFO);
+
+    // Cholesky factorization of a symmetric positive definite matrix
+    void spotrf_(char* UPLO, int* N, float* A, int* lda, int* INFO);
+    void dpotrf_(char* UPLO, int* N, double* A, int* lda, int* INFO);
+
+    // inverse of a symmetric positive definite matrix from its Cholesky factor
+    void spotri_(char* UPLO, int* N, float* A, int* lda, int* INFO);
+    void dpotri_(char* UPLO, int* N, double* A, int* lda, int* INFO);
+
+    // solve A X = B given the Cholesky factor of A
+    void spotrs_(char* UPLO, int* N, int* NRHS, float* A, int* lda, float* B, int* ldb, int* INFO);
+    void dpotrs_(char* UPLO, int* N, int* NRHS, double* A, int* lda, double* B, int* ldb, int* INFO);
+
+    // eigenvalues and eigenvectors of a symmetric matrix (divide and conquer)
+    void ssyevd_(char* JOBZ, char* UPLO, int* N, float* A, int* lda, float* W,
+		 float* WORK, int* lwork, int* IWORK, int* liwork, int* INFO);
+    void dsyevd_(char* JOBZ, char* UPLO, int* N, double* A, int* lda, double* W,
+		 double* WORK, int* lwork, int* IWORK, int* liwork, int* INFO);
+
+    // C = alpha * A * A^T + beta * C, one triangle of C only
+    void ssyrk_(char* UPLO, char* TRANS, int* N, int* K, float* alpha, float* A, int* lda,
+		float* beta, float* C, int* ldc);
+    void dsyrk_(char* UPLO, char* TRANS, int* N, int* K, double* alpha, double* A, int* lda,
+		double* beta, double* C, int* ldc);
+
+    // C = alpha * op(A) * op(B) + beta * C
+    void sgemm_(char* TRANSA, char* TRANSB, int* M, int* N, int* K, float* alpha, float* A, int* lda,
+		float* B, int* ldb, float* beta, float* C, int* ldc);
+    void dgemm_(char* TRANSA, char* TRANSB, int* M, int* N, int* K, double* alpha, double* A, int* lda,
+		double* B, int* ldb, double* beta, double* C, int* ldc);
+
+    // B = alpha * op(A)^-1 * B or alpha * B * op(A)^-1, A triangular
+    void strsm_(char* SIDE, char* UPLO, char* TRANSA, char* DIAG, int* M, int* N, float* alpha,
+		float* A, int* lda, float* B, int* ldb);
+    void dtrsm_(char* SIDE, char* UPLO, char* TRANSA, char* DIAG, int* M, int* N, double* alpha,
+		double* A, int* lda, double* B, int* ldb);
+
+    // B = alpha * op(A) * B or alpha * B * op(A), A triangular
+    void strmm_(char* SIDE, char* UPLO, char* TRANSA, char* DIAG, int* M, int* N, float* alpha,
+		float* A, int* lda, float* B, int* ldb);
+    void dtrmm_(char* SIDE, char* UPLO, char* TRANSA, char* DIAG, int* M, int* N, double* alpha,
+		double* A, int* lda, double* B, int* ldb);
+
+    // inverse of a triangular matrix
+    void strtri_(char* UPLO, char* DIAG, int* N, float* A, int* lda, int* INFO);
+    void dtrtri_(char* UPLO, char* DIAG, int* N, double* A, int* lda, int* INFO);
+
+    // L^T L (or U U^T) of a triangular matrix, in place
+    void slauum_(char* UPLO, int* N, float* A, int* lda, int* INFO);
+    void dlauum_(char* UPLO, int* N, double* A, int* lda, int* INFO);
+}
+
+inline void getrf(int* n, float* a, int* ipiv, int* info) { sgetrf_(n, n, a, n, ipiv, info); }
+inline void getrf(int* n, double* a, int* ipiv, int* info) { dgetrf_(n, n, a, n, ipiv, info); }
+inline void getri(int* n, float* a, int* ipiv, float* work, int* lwork, int* info) { sgetri_(n, a, n, ipiv, work, lwork, info); }
+inline void getri(int* n, double* a, int* ipiv, double* work, int* lwork, int* info) { dgetri_(n, a, n, ipiv, work, lwork, info); }
+inline void getrs(int* n, int* nrhs, float* a, int* ipiv, float* b, int* info) {
+  char trans = 'N';
+  sgetrs_(&trans, n, nrhs, a, n, ipiv, b, n, info);
+}
+inline void getrs(int* n, int* nrhs, double* a, int* ipiv, double* b, int* info) {
+  char trans = 'N';
+  dgetrs_(&trans, n, nrhs, a, n, ipiv, b, n, info);
+}
+
+inline void potrf(char* uplo, int* n, float* a, int* info) { spotrf_(uplo, n, a, n, info); }
+inline void potrf(char* uplo, int* n, double* a, int* info) { dpotrf_(uplo, n, a, n, info); }
+inline void potri(char* uplo, int* n, float* a, int* info) { spotri_(uplo, n, a, n, info); }
+inline void potri(char* uplo, int* n, double* a, int* info) { dpotri_(uplo, n, a, n, info); }
+inline void potrs(char* uplo, int* n, int* nrhs, float* a, float* b, int* info) { spotrs_(uplo, n, nrhs, a, n, b, n, info); }
+inline void potrs(char* uplo, int* n, int* nrhs, double* a, double* b, int* info) { dpotrs_(uplo, n, nrhs, a, n, b, n, info); }
+inline void syevd(char* jobz, char* uplo, int* n, float* a, float* w, float* work, int* lwork, int* iwork, int* liwork, int* info) {
+  ssyevd_(jobz, uplo, n, a, n, w, work, lwork, iwork, liwork, info);
+}
+inline void syevd(char* jobz, char* uplo, int* n, double* a, double* w, double* work, int* lwork, int* iwork, int* liwork, int* info) {
+  dsyevd_(jobz, uplo, n, a, n, w, work, lwork, iwork, liwork, info);
+}
+inline void syrk(char* uplo, char* trans, int* n, int* k, float* alpha, float* a, float* beta, float* c) {
+  int lda = (*trans == 'N') ? *n : *k;
+  ssyrk_(uplo, trans, n, k, alpha, a, &lda, beta, c, n);
+}
+inline void syrk(char* uplo, char* trans, int* n, int* k, double* alpha, double* a, double* beta, double* c) {
+  int lda = (*trans == 'N') ? *n : *k;
+  dsyrk_(uplo, trans, n, k, alpha, a, &lda, beta, c, n);
+}
+inline void gemm(char* ta, char* tb, int* m, int* n, int* k, float* alpha, float* a, float* b, float* beta, float* c) {
+  int lda = (*ta == 'N') ? *m : *k, ldb = (*tb == 'N') ? *k : *n;
+  sgemm_(ta, tb, m, n, k, alpha, a, &lda, b, &ldb, beta, c, m);
+}
+inline void gemm(char* ta, char* tb, int* m, int* n, int* k, double* alpha, double* a, double* b, double* beta, double* c) {
+  int lda = (*ta == 'N') ? *m : *k, ldb = (*tb == 'N') ? *k : *n;
+  dgemm_(ta, tb, m, n, k, alpha, a, &lda, b, &ldb, beta, c, m);
+}
+inline void trsm(char* side, char* uplo, char* transa, int* m, int* n, float* alpha, float* a, float* b) {
+  char diag = 'N';
+  int lda = (*side == 'L') ? *m : *n;
+  strsm_(side, uplo, transa, &diag, m, n, alpha, a, &lda, b, m);
+}
+inline void trsm(char* side, char* uplo, char* transa, int* m, int* n, double* alpha, double* a, double* b) {
+  char diag = 'N';
+  int lda = (*side == 'L') ? *m : *n;
+  dtrsm_(side, uplo, transa, &diag, m, n, alpha, a, &lda, b, m);
+}
+inline void trmm(char* side, char* uplo, char* transa, int* m, int* n, float* alpha, float* a, float* b) {
+  char diag = 'N';
+  int lda = (*side == 'L') ? *m : *n;
+  strmm_(side, uplo, transa, &diag, m, n, alpha, a, &lda, b, m);
+}
+inline void trmm(char* side, char* uplo, char* transa, int* m, int* n, double* alpha, double* a, double* b) {
+  char diag = 'N';
+  int lda = (*side == 'L') ? *m : *n;
+  dtrmm_(side, uplo, transa, &diag, m, n, alpha, a, &lda, b, m);
+}
+inline void trtri(char* uplo, int* n, float* a, int* info) { char diag = 'N'; strtri_(uplo, &diag, n, a, n, info); }
+inline void trtri(char* uplo, int* n, double* a, int* info) { char diag = 'N'; dtrtri_(uplo, &diag, n, a, n, info); }
+inline void lauum(char* uplo, int* n, float* a, int* info) { slauum_(uplo, n, a, n, info); }
+inline void lauum(char* uplo, int* n, double* a, int* info) { dlauum_(uplo, n, a, n, info); }
+
+#endif
@@ -0,0 +1,60 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** MappedFile.cpp
+** This file implements the MappedFile class.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "MappedFile.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+
+bool MappedFile::open(const std::string& filename) {
+  close();
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping keeps its own reference to the file.
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    printf("Could not map file %s of %lld bytes.\n", filename.c_str(), (long long)st.st_size);
+    return false;
+  }
+  mData = (const char*)p;
+  mSize = st.st_size;
+  return true;
+}
+
+void MappedFile::close(void) {
+  if (mData != 0) {
+    munmap((void*)mData, mSize);
+    mData = 0;
+    mSize = 0;
+  }
+}
+
+void MappedFile::adviseSequential(void) const {
+  if (mData != 0) {
+    madvise((void*)mData, mSize, MADV_SEQUENTIAL);
+  }
+}
+
+void MappedFile::adviseRandom(void) const {
+  if (mData != 0) {
+    madvise((void*)mData, mSize, MADV_RANDOM);
+  }
+}
@@ -0,0 +1,42 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** MappedFile.h
+** Read-only memory mapping of a whole file.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+class MappedFile {
+ public:
+  MappedFile(void) : mData(0), mSize(0) {}
+  ~MappedFile(void) { close(); }
+
+  bool open(const std::string& filename);
+  void close(void);
+  // Hint to the kernel that the mapping will be read front to back.
+  void adviseSequential(void) const;
+  // Hint that only scattered parts will be read, so read-ahead is wasted.
+  void adviseRandom(void) const;
+
+  const char* data(void) const { return mData; }
+  size_t size(void) const { return mSize; }
+  bool isOpen(void) const { return mData != 0; }
+
+ private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char* mData;
+  size_t mSize;
+};
+
+#endif
@@ -0,0 +1,133 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** MatrixIndex.cpp
+** This file implements building and reading of matrix row index sidecars.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "MatrixIndex.h"
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static bool statMatrix(const std::string& filename, uint64_t& bytes, int64_t& mtime) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  bytes = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
+
+std::string matrixIndexFilename(const std::string& matrixFilename) {
+  return matrixFilename + MATRIX_INDEX_SUFFIX;
+}
+
+bool writeMatrixIndex(const std::string& matrixFilename) {
+  const std::string indexFilename = matrixIndexFilename(matrixFilename);
+  MappedFile mapped;
+  TMatrixIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  if (!statMatrix(matrixFilename, header.matrixBytes, header.matrixMtime) ||
+      !mapped.open(matrixFilename)) {
+    printf("Problem reading matrix from file %s\n", matrixFilename.c_str());
+    return false;
+  }
+  mapped.adviseSequential();
+  const char* const begin = mapped.data();
+  const char* const end = begin + mapped.size();
+
+  // Rows start after the names line. Row r ends one byte before offset
+  // r + 1, as if the file ended in a newline.
+  std::vector<uint64_t> rows;
+  const char* nl = (const char*)memchr(begin, '\n', end - begin);
+  const char* p = (nl == 0) ? end : nl + 1;
+  header.dataOffset = p - begin;
+  bool more(nl != 0);
+  while (more) {
+    rows.push_back(p - begin);
+    nl = (p < end) ? (const char*)memchr(p, '\n', end - p) : 0;
+    more = (nl != 0);
+    p = (nl == 0) ? end : nl + 1;
+  }
+  rows.push_back(mapped.size() + 1);
+
+  memcpy(header.magic, MATRIX_INDEX_MAGIC, sizeof(header.magic));
+  header.version = MATRIX_INDEX_VERSION;
+  header.headerBytes = sizeof(TMatrixIndexHeader);
+  header.numRows = rows.size() - 1;
+
+  FILE* f = fopen(indexFilename.c_str(), "wb");
+  if (f == 0) {
+    printf("Could not open index file %s for writing.\n", indexFilename.c_str());
+    return false;
+  }
+  bool ok = (fwrite(&header, sizeof(header), 1, f) == 1 &&
+	     fwrite(&rows[0], sizeof(uint64_t), rows.size(), f) == rows.size());
+  if (fclose(f) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    printf("Problem writing index file %s\n", indexFilename.c_str());
+  }
+  return ok;
+}
+
+bool MatrixIndex::open(const std::string& filename) {
+  close();
+  if (!mFile.open(filename)) {
+    return false;
+  }
+  const TMatrixIndexHeader* header = (const TMatrixIndexHeader*)mFile.data();
+  if (mFile.size() < sizeof(TMatrixIndexHeader) ||
+      memcmp(header->magic, MATRIX_INDEX_MAGIC, sizeof(header->magic)) != 0) {
+    printf("%s is not a matrix index.\n", filename.c_str());
+    mFile.close();
+    return false;
+  }
+  if (header->version != MATRIX_INDEX_VERSION || header->headerBytes != sizeof(TMatrixIndexHeader)) {
+    printf("Matrix index %s is from another version; run indexmatrix again.\n", filename.c_str());
+    mFile.close();
+    return false;
+  }
+  const uint64_t offsets = header->numRows + 1;
+  if (mFile.size() != header->headerBytes + sizeof(uint64_t) * offsets) {
+    printf("Matrix index %s is truncated.\n", filename.c_str());
+    mFile.close();
+    return false;
+  }
+  mHeader = header;
+  return true;
+}
+
+void MatrixIndex::close(void) {
+  mFile.close();
+  mHeader = 0;
+}
+
+bool MatrixIndex::matches(const std::string& matrixFilename) const {
+  uint64_t bytes;
+  int64_t mtime;
+  return (isOpen() && statMatrix(matrixFilename, bytes, mtime) &&
+	  bytes == mHeader->matrixBytes && mtime == mHeader->matrixMtime);
+}
+
+bool openMatrixIndex(const std::string& matrixFilename, MatrixIndex& index) {
+  const std::string filename = matrixIndexFilename(matrixFilename);
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0 || !index.open(filename)) {
+    return false;
+  }
+  if (!index.matches(matrixFilename)) {
+    printf("Ignoring stale matrix index %s.\n", filename.c_str());
+    index.close();
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,72 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** MatrixIndex.h
+** Sidecar index of byte offsets into a text similarity matrix, so that
+** wanted rows can be read without scanning the rows before them.
+**
+** An index file (the matrix name plus MATRIX_INDEX_SUFFIX) is:
+**   TMatrixIndexHeader
+**   numRows + 1 uint64 row offsets; row r spans [offset[r], offset[r + 1] - 1)
+**
+** Rows are counted the way std::getline sees them, so a trailing newline is
+** followed by one empty row. The matrix size and modification time are
+** recorded and an index that no longer matches its matrix is ignored.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef MATRIXINDEX_H
+#define MATRIXINDEX_H
+
+#include "MappedFile.h"
+#include <string>
+#include <stdint.h>
+
+#define MATRIX_INDEX_MAGIC "PRMSMIDX"
+#define MATRIX_INDEX_VERSION 2
+#define MATRIX_INDEX_SUFFIX ".idx"
+
+struct TMatrixIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerBytes;
+  uint64_t matrixBytes;
+  int64_t matrixMtime;
+  uint64_t numRows;
+  // First byte after the names line.
+  uint64_t dataOffset;
+};
+
+class MatrixIndex {
+ public:
+  MatrixIndex(void) : mHeader(0) {}
+
+  bool open(const std::string& filename);
+  void close(void);
+  bool isOpen(void) const { return mHeader != 0; }
+  // True when the index was built from the matrix file as it is now.
+  bool matches(const std::string& matrixFilename) const;
+
+  uint64_t numRows(void) const { return mHeader->numRows; }
+  uint64_t dataOffset(void) const { return mHeader->dataOffset; }
+  uint64_t rowBegin(const uint64_t r) const { return rows()[r]; }
+  // Offset of the row's newline, or of the end of the file for the last row.
+  uint64_t rowEnd(const uint64_t r) const { return rows()[r + 1] - 1; }
+
+ private:
+  const uint64_t* rows(void) const { return (const uint64_t*)(mFile.data() + mHeader->headerBytes); }
+
+  MappedFile mFile;
+  const TMatrixIndexHeader* mHeader;
+};
+
+std::string matrixIndexFilename(const std::string& matrixFilename);
+// Writes the sidecar index of matrixFilename.
+bool writeMatrixIndex(const std::string& matrixFilename);
+// Opens the sidecar index of matrixFilename if there is one and it is current.
+bool openMatrixIndex(const std::string& matrixFilename, MatrixIndex& index);
+
+#endif
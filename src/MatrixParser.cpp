@@ -0,0 +1,384 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** MatrixParser.cpp
+** This file implements the threaded text matrix parser.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "MatrixParser.h"
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <stdint.h>
+
+static const double kPowersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isBlank(const char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool isDigit(const char c) {
+  return c >= '0' && c <= '9';
+}
+
+// strtof on a copy of the token, which is what operator>> ends up calling.
+// Infinite results are rejected the same way the stream rejects them.
+static const char* slowParseValue(const char* start, const char* const tokenEnd, float& v) {
+  char buffer[128];
+  const size_t len = tokenEnd - start;
+  if (len >= sizeof(buffer)) {
+    return 0;
+  }
+  memcpy(buffer, start, len);
+  buffer[len] = '\0';
+  char* parsed(0);
+  const float f = strtof(buffer, &parsed);
+  if (parsed != buffer + len || std::isinf(f)) {
+    return 0;
+  }
+  v = f;
+  return tokenEnd;
+}
+
+const char* parseMatrixValue(const char* p, const char* const end, float& v) {
+  while (p < end && isBlank(*p)) {
+    ++p;
+  }
+  const char* const start = p;
+  bool negative(false);
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    ++p;
+  }
+
+  // Up to 19 significant digits fit in the mantissa exactly.
+  uint64_t mantissa(0);
+  int significant(0), exponent(0), digits(0);
+  bool truncated(false);
+  for (; p < end && isDigit(*p); ++p, ++digits) {
+    if (significant < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa != 0) significant++;
+    } else {
+      truncated = true;
+      exponent++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && isDigit(*p); ++p, ++digits) {
+      if (significant < 19) {
+	mantissa = mantissa * 10 + (*p - '0');
+	if (mantissa != 0) significant++;
+	exponent--;
+      } else {
+	truncated = true;
+      }
+    }
+  }
+  if (digits == 0) {
+    return 0;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* e = p + 1;
+    bool negativeExponent(false);
+    if (e < end && (*e == '-' || *e == '+')) {
+      negativeExponent = (*e == '-');
+      ++e;
+    }
+    if (e == end || !isDigit(*e)) {
+      // "1e" and friends: let strtof decide, as the stream would.
+      const char* tokenEnd = e;
+      while (tokenEnd < end && !isBlank(*tokenEnd) && *tokenEnd != '\n') ++tokenEnd;
+      return slowParseValue(start, tokenEnd, v);
+    }
+    int e10(0);
+    for (; e < end && isDigit(*e); ++e) {
+      if (e10 < 100000) e10 = e10 * 10 + (*e - '0');
+    }
+    exponent += negativeExponent ? -e10 : e10;
+    p = e;
+  }
+
+  // Fast path: mantissa and power of ten are both exact doubles, so the
+  // quotient/product is the correctly rounded double. Narrowing that to float
+  // is only ambiguous when it lands exactly halfway between two floats.
+  if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+    double d = (double)mantissa;
+    d = (exponent < 0) ? d / kPowersOfTen[-exponent] : d * kPowersOfTen[exponent];
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    const uint64_t dropped = bits & ((1ULL << 29) - 1);
+    if (d == 0.0 || dropped != (1ULL << 28)) {
+      const float f = (float)d;
+      v = negative ? -f : f;
+      return p;
+    }
+  }
+  return slowParseValue(start, p, v);
+}
+
+const char* skipMatrixValue(const char* p, const char* const end) {
+  while (p < end && isBlank(*p)) {
+    ++p;
+  }
+  const char* const start = p;
+  if (p < end && (*p == '-' || *p == '+')) {
+    ++p;
+  }
+  // Track the decimal magnitude so that values operator>> would reject as
+  // out of float range are handed to the real parser.
+  int digits(0), intDigits(0), leadingZeros(0);
+  bool nonZero(false);
+  for (; p < end && isDigit(*p); ++p, ++digits) {
+    nonZero = nonZero || (*p != '0');
+    intDigits += nonZero ? 1 : 0;
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && isDigit(*p); ++p, ++digits) {
+      leadingZeros += nonZero ? 0 : (*p == '0');
+      nonZero = nonZero || (*p != '0');
+    }
+  }
+  if (digits == 0) {
+    return 0;
+  }
+  int exp10(0);
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* e = p + 1;
+    bool negative(false);
+    if (e < end && (*e == '-' || *e == '+')) {
+      negative = (*e == '-');
+      ++e;
+    }
+    if (e == end || !isDigit(*e)) {
+      float v;
+      return parseMatrixValue(start, end, v);
+    }
+    for (; e < end && isDigit(*e); ++e) {
+      if (exp10 < 10000) {
+	exp10 = exp10 * 10 + (*e - '0');
+      }
+    }
+    exp10 = negative ? -exp10 : exp10;
+    p = e;
+  }
+  if (nonZero) {
+    const int magnitude = (intDigits > 0) ? intDigits - 1 + exp10 : exp10 - leadingZeros - 1;
+    if (magnitude < -30 || magnitude > 30) {
+      float v;
+      return parseMatrixValue(start, end, v);
+    }
+  }
+  return p;
+}
+
+// Parse one line, keeping columns >= firstCol at dst[col - firstCol].
+static int parseLineFrom(const char* p, const char* const end, const int numNodes, const int firstCol, float* const dst) {
+  int col(0);
+  float v;
+  while (col < numNodes) {
+    const char* next = parseMatrixValue(p, end, v);
+    if (next == 0) {
+      break;
+    }
+    if (col >= firstCol) {
+      dst[col - firstCol] = v;
+    }
+    col++;
+    p = next;
+  }
+  return col;
+}
+
+int parseMatrixLine(const char* begin, const char* const end, const int numNodes, float* const row) {
+  return parseLineFrom(begin, end, numNodes, 0, row);
+}
+
+static int countLines(const char* p, const char* const end) {
+  int n(0);
+  while (p < end) {
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    if (nl == 0) break;
+    n++;
+    p = nl + 1;
+  }
+  return n;
+}
+
+static void parseChunk(const char* p, const char* const end, int row, const int numNodes,
+		       const bool packed, float* const mat) {
+  while (p < end && row < numNodes) {
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    const char* const lineEnd = (nl == 0) ? end : nl;
+    if (packed) {
+      // Row r of the triangle starts after r rows of shrinking length.
+      const size_t start = (size_t)row * numNodes - (size_t)row * (row - 1) / 2;
+      parseLineFrom(p, lineEnd, numNodes, row, mat + start);
+    } else {
+      parseLineFrom(p, lineEnd, numNodes, 0, mat + (size_t)numNodes * row);
+    }
+    row++;
+    p = lineEnd + 1;
+  }
+}
+
+static void parseChunkRows(const char* p, const char* const end, int row, const int numNodes,
+			   IMatrixRowSink& sink) {
+  std::vector<float> values(numNodes);
+  while (p < end && row < numNodes) {
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    const char* const lineEnd = (nl == 0) ? end : nl;
+    std::fill(values.begin(), values.end(), 0.0f);
+    parseLineFrom(p, lineEnd, numNodes, 0, &values[0]);
+    sink.addRow(row, &values[0]);
+    row++;
+    p = lineEnd + 1;
+  }
+}
+
+// Split the lines after offset into one chunk per thread and run
+// parse(begin, end, firstRow) on each chunk in parallel.
+template <typename F>
+static bool parseMapped(const MappedFile& file, const size_t offset, int numThreads, const F& parse) {
+  if (!file.isOpen() || offset > file.size()) {
+    return false;
+  }
+  const char* const begin = file.data() + offset;
+  const char* const end = file.data() + file.size();
+  if (numThreads <= 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  // Keep chunks big enough that thread start-up does not dominate.
+  const size_t minChunk = 1 << 20;
+  const size_t bytes = end - begin;
+  if ((size_t)numThreads > bytes / minChunk + 1) {
+    numThreads = bytes / minChunk + 1;
+  }
+
+  // Chunk boundaries sit just after a newline, so every chunk holds whole lines.
+  std::vector<const char*> bounds(numThreads + 1, end);
+  bounds[0] = begin;
+  for (int t = 1; t < numThreads; ++t) {
+    const char* p = begin + bytes * t / numThreads;
+    if (p < bounds[t - 1]) p = bounds[t - 1];
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    bounds[t] = (nl == 0) ? end : nl + 1;
+  }
+
+  // Pass 1: count lines per chunk to find the first row of each chunk.
+  std::vector<int> firstRow(numThreads + 1, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    threads.push_back(std::thread([&, t]() {
+	  firstRow[t + 1] = countLines(bounds[t], bounds[t + 1]);
+	}));
+  }
+  for (auto &th : threads) th.join();
+  threads.clear();
+  for (int t = 1; t <= numThreads; ++t) {
+    firstRow[t] += firstRow[t - 1];
+  }
+
+  // Pass 2: parse chunks in parallel, each straight into its rows.
+  for (int t = 0; t < numThreads; ++t) {
+    threads.push_back(std::thread([&, t]() {
+	  parse(bounds[t], bounds[t + 1], firstRow[t]);
+	}));
+  }
+  for (auto &th : threads) th.join();
+  return true;
+}
+
+bool readEntireNetwork(const MappedFile& file, const size_t offset, const int numNodes, float* const mat, const int numThreads) {
+  return parseMapped(file, offset, numThreads, [=](const char* begin, const char* end, int row) {
+      parseChunk(begin, end, row, numNodes, false, mat);
+    });
+}
+
+bool readEntireNetworkPacked(const MappedFile& file, const size_t offset, const int numNodes, float* const packed, const int numThreads) {
+  return parseMapped(file, offset, numThreads, [=](const char* begin, const char* end, int row) {
+      parseChunk(begin, end, row, numNodes, true, packed);
+    });
+}
+
+bool readNetworkRows(const MappedFile& file, const size_t offset, const int numNodes, IMatrixRowSink& sink, const int numThreads) {
+  return parseMapped(file, offset, numThreads, [&](const char* begin, const char* end, int row) {
+      parseChunkRows(begin, end, row, numNodes, sink);
+    });
+}
+
+void parseMatrixColumns(const char* p, const char* const end,
+			const std::vector<int>& indices, float* const row) {
+  std::vector<int>::const_iterator curr_col = indices.begin();
+  int col = 0, colNew = 0;
+  while (curr_col != indices.end()) {
+    if (col == *curr_col) {
+      float v;
+      p = parseMatrixValue(p, end, v);
+      if (p == 0) break;
+      row[colNew++] = v;
+      curr_col++;
+    } else {
+      p = skipMatrixValue(p, end);
+      if (p == 0) break;
+    }
+    col++;
+  }
+}
+
+bool readEntriesFromNetwork(const MappedFile& file, const size_t offset, const GeneDictionary& fullMap,
+			    const std::vector<std::string>& entries, GeneDictionary& newNameMap,
+			    float* const mat, const int width, const MatrixIndex* const index) {
+  if (!file.isOpen() || offset > file.size() ||
+      (index != 0 && index->dataOffset() != offset)) {
+    return false;
+  }
+  std::vector<int> indices;
+  entryIndices(fullMap, entries, indices);
+
+  const char* const data = file.data();
+  float* curr_mat(mat);
+  std::vector<int>::const_iterator itrow = indices.begin();
+  int ii = 0;
+
+  if (index != 0) {
+    // Seek straight to each wanted row.
+    file.adviseRandom();
+    for (; itrow != indices.end() && (uint64_t)*itrow < index->numRows(); ++itrow) {
+      parseMatrixColumns(data + index->rowBegin(*itrow), data + index->rowEnd(*itrow), indices, curr_mat);
+      curr_mat += width;
+      ii++;
+    }
+  } else {
+    const char* p = data + offset;
+    const char* const end = data + file.size();
+    int row = 0;
+    // As with std::getline, a trailing newline is followed by one empty line.
+    bool more(true);
+    while (more && itrow != indices.end()) {
+      const char* nl = (p < end) ? (const char*)memchr(p, '\n', end - p) : 0;
+      const char* const lineEnd = (nl == 0) ? end : nl;
+      more = (nl != 0);
+      if (row == *itrow) {
+	parseMatrixColumns(p, lineEnd, indices, curr_mat);
+	curr_mat += width;
+	ii++;
+	itrow++;
+      }
+      row++;
+      p = lineEnd + (more ? 1 : 0);
+    }
+  }
+
+  mapExtractedEntries(fullMap, indices, ii, newNameMap);
+  return true;
+}
@@ -0,0 +1,70 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** MatrixParser.h
+** Allocation-free parsing of text similarity matrices straight out of a
+** memory-mapped file, split across threads.
+**
+** The results are bit-for-bit the same as reading the values with a
+** std::stringstream: values are correctly rounded, and a row stops at the
+** first token operator>> would reject. The stream readers in coreroutines.cpp
+** use the same line parsers.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef MATRIXPARSER_H
+#define MATRIXPARSER_H
+
+#include "coreroutines.h"
+#include "MappedFile.h"
+#include "MatrixIndex.h"
+
+// Parse one value starting at p (leading blanks are skipped). Returns the
+// position after the value, or 0 if there is no value before the line ends.
+const char* parseMatrixValue(const char* p, const char* const end, float& v);
+
+// Step over one value without converting it. Returns 0 where
+// parseMatrixValue would fail.
+const char* skipMatrixValue(const char* p, const char* const end);
+
+// Parse up to numNodes values from the line [begin, end). Returns the number
+// of values stored in row.
+int parseMatrixLine(const char* begin, const char* const end, const int numNodes, float* const row);
+
+// Parse the columns listed in the sorted indices from the line [begin, end)
+// into consecutive slots of row, stopping after the last of them. Columns in
+// between are stepped over without being converted.
+void parseMatrixColumns(const char* begin, const char* const end,
+			const std::vector<int>& indices, float* const row);
+
+// Parse the matrix whose first row starts offset bytes into file. Row r of the
+// matrix is line r after the offset. numThreads <= 0 uses every core.
+bool readEntireNetwork(const MappedFile& file, const size_t offset, const int numNodes,
+		       float* const mat, const int numThreads = 0);
+bool readEntireNetworkPacked(const MappedFile& file, const size_t offset, const int numNodes,
+			     float* const packed, const int numThreads = 0);
+
+// Receives rows of a matrix as they are parsed. addRow may be called from
+// several threads at once, but only once per row.
+class IMatrixRowSink {
+ public:
+  virtual ~IMatrixRowSink() {}
+  virtual void addRow(const int row, const float* const values) = 0;
+};
+
+// Parse the matrix like readEntireNetwork, but hand each full row to sink
+// instead of storing it. Values missing from short rows are zero.
+bool readNetworkRows(const MappedFile& file, const size_t offset, const int numNodes,
+		     IMatrixRowSink& sink, const int numThreads = 0);
+
+// Mapped counterpart of readEntriesFromNetwork. Rows that are not wanted are
+// skipped with a newline scan, or not touched at all when a row index is
+// given, and a wanted row is only tokenized up to its last wanted column.
+bool readEntriesFromNetwork(const MappedFile& file, const size_t offset, const GeneDictionary& fullMap,
+			    const std::vector<std::string>& entries, GeneDictionary& newNameMap,
+			    float* const mat, const int width, const MatrixIndex* const index = 0);
+
+#endif
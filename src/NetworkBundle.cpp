@@ -0,0 +1,332 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** NetworkBundle.cpp
+** This file implements reading and writing of binary network bundles.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "NetworkBundle.h"
+#include <cstring>
+#include <cmath>
+#include <memory>
+
+void BundleChecksum::update(const void* data, size_t bytes) {
+  // FNV-1a
+  const unsigned char* p = (const unsigned char*)data;
+  uint64_t h(mHash);
+  for (size_t i = 0; i < bytes; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  mHash = h;
+}
+
+static uint64_t alignUp(const uint64_t v, const uint64_t alignment) {
+  return ((v + alignment - 1) / alignment) * alignment;
+}
+
+NetworkBundleWriter::~NetworkBundleWriter(void) {
+  if (mFile != 0) {
+    fclose(mFile);
+  }
+}
+
+static uint64_t int8ScalesOffset(const uint64_t numNodes) {
+  return alignUp(numNodes * numNodes, 8);
+}
+
+static uint64_t layoutBytes(const uint64_t numNodes, const TSimilarityLayout layout, const uint64_t rank) {
+  switch (layout) {
+  case kPackedLayout:
+    return sizeof(float) * numNodes * (numNodes + 1) / 2;
+  case kFactorLayout:
+    return sizeof(float) * numNodes * rank;
+  case kHalfLayout:
+    return sizeof(uint16_t) * numNodes * numNodes;
+  case kInt8Layout:
+    return int8ScalesOffset(numNodes) + 2 * sizeof(float) * numNodes;
+  default:
+    return sizeof(float) * numNodes * numNodes;
+  }
+}
+
+bool NetworkBundleWriter::begin(const std::string& filename, const std::vector<std::string>& names, const TSimilarityLayout layout,
+			       const int rank) {
+  mFile = fopen(filename.c_str(), "wb");
+  if (mFile == 0) {
+    printf("Could not open bundle file %s for writing.\n", filename.c_str());
+    return false;
+  }
+
+  memset(&mHeader, 0, sizeof(mHeader));
+  memcpy(mHeader.magic, BUNDLE_MAGIC, sizeof(mHeader.magic));
+  mHeader.version = BUNDLE_VERSION;
+  mHeader.headerBytes = sizeof(TBundleHeader);
+  mHeader.layout = layout;
+  mHeader.rank = (layout == kFactorLayout) ? rank : 0;
+  mHeader.numNodes = names.size();
+  mHeader.namesOffset = sizeof(TBundleHeader);
+  for (auto const &name : names) {
+    mHeader.namesBytes += name.size() + 1;
+  }
+  mHeader.matrixOffset = alignUp(mHeader.namesOffset + mHeader.namesBytes, BUNDLE_ALIGNMENT);
+  mHeader.matrixBytes = layoutBytes(mHeader.numNodes, layout, mHeader.rank);
+  mScales.clear();
+  mDiagonal.clear();
+
+  // The header is rewritten with the checksum once all rows are in.
+  if (fwrite(&mHeader, sizeof(mHeader), 1, mFile) != 1) {
+    return false;
+  }
+  for (auto const &name : names) {
+    fwrite(name.c_str(), 1, name.size() + 1, mFile);
+    mChecksum.update(name.c_str(), name.size() + 1);
+  }
+  const uint64_t padding = mHeader.matrixOffset - (mHeader.namesOffset + mHeader.namesBytes);
+  for (uint64_t i = 0; i < padding; ++i) {
+    fputc(0, mFile);
+  }
+  mRowsWritten = 0;
+  return ferror(mFile) == 0;
+}
+
+bool NetworkBundleWriter::writeRow(const float* row) {
+  if (mFile == 0 || mRowsWritten >= mHeader.numNodes) {
+    return false;
+  }
+  size_t n = mHeader.numNodes;
+  if (mHeader.layout == kPackedLayout) {
+    row += mRowsWritten;
+    n -= mRowsWritten;
+  } else if (mHeader.layout == kFactorLayout) {
+    n = mHeader.rank;
+  }
+
+  bool written;
+  if (mHeader.layout == kHalfLayout) {
+    std::vector<uint16_t> halves(n);
+    for (size_t j = 0; j < n; ++j) {
+      halves[j] = floatToHalf(row[j]);
+    }
+    written = fwrite(&halves[0], sizeof(uint16_t), n, mFile) == n;
+    mChecksum.update(&halves[0], sizeof(uint16_t) * n);
+  } else if (mHeader.layout == kInt8Layout) {
+    const size_t i = mRowsWritten;
+    float largest(0.0f);
+    for (size_t j = 0; j < n; ++j) {
+      if (j != i) {
+	largest = std::max(largest, std::fabs(row[j]));
+      }
+    }
+    const float scale = largest / 127.0f;
+    std::vector<int8_t> bytes(n, 0);
+    if (scale > 0.0f) {
+      for (size_t j = 0; j < n; ++j) {
+	bytes[j] = (j == i) ? 0 : (int8_t)lrintf(row[j] / scale);
+      }
+    }
+    mScales.push_back(scale);
+    mDiagonal.push_back(row[i]);
+    written = fwrite(&bytes[0], 1, n, mFile) == n;
+    mChecksum.update(&bytes[0], n);
+  } else {
+    written = fwrite(row, sizeof(float), n, mFile) == n;
+    mChecksum.update(row, sizeof(float) * n);
+  }
+  if (!written) {
+    printf("Problem writing row %d of network bundle.\n", (int)mRowsWritten);
+    return false;
+  }
+  mRowsWritten++;
+  return true;
+}
+
+bool NetworkBundleWriter::finish(void) {
+  if (mFile == 0) {
+    return false;
+  }
+  bool ok(mRowsWritten == mHeader.numNodes);
+  if (!ok) {
+    printf("Network bundle is incomplete: %d of %d rows written.\n",
+	   (int)mRowsWritten, (int)mHeader.numNodes);
+  }
+  if (ok && mHeader.layout == kInt8Layout) {
+    const uint64_t n = mHeader.numNodes;
+    const uint64_t padding = int8ScalesOffset(n) - n * n;
+    for (uint64_t i = 0; i < padding; ++i) {
+      const char zero(0);
+      fputc(zero, mFile);
+      mChecksum.update(&zero, 1);
+    }
+    if (n > 0 && (fwrite(&mScales[0], sizeof(float), n, mFile) != n ||
+		  fwrite(&mDiagonal[0], sizeof(float), n, mFile) != n)) {
+      ok = false;
+    } else if (n > 0) {
+      mChecksum.update(&mScales[0], sizeof(float) * n);
+      mChecksum.update(&mDiagonal[0], sizeof(float) * n);
+    }
+  }
+  mHeader.checksum = mChecksum.value();
+  if (fseek(mFile, 0, SEEK_SET) != 0 || fwrite(&mHeader, sizeof(mHeader), 1, mFile) != 1) {
+    ok = false;
+  }
+  if (fclose(mFile) != 0) {
+    ok = false;
+  }
+  mFile = 0;
+  return ok;
+}
+
+bool writeNetworkBundle(const std::string& filename, const std::vector<std::string>& names, const float* const mat, const TSimilarityLayout layout) {
+  NetworkBundleWriter writer;
+  if (!writer.begin(filename, names, layout)) {
+    return false;
+  }
+  const int n = names.size();
+  for (int i = 0; i < n; ++i) {
+    if (!writer.writeRow(mat + (size_t)n * i)) {
+      return false;
+    }
+  }
+  return writer.finish();
+}
+
+bool isNetworkBundle(const std::string& filename) {
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (f == 0) {
+    return false;
+  }
+  char magic[8];
+  const bool isBundle = (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+			 memcmp(magic, BUNDLE_MAGIC, sizeof(magic)) == 0);
+  fclose(f);
+  return isBundle;
+}
+
+bool NetworkBundle::open(const std::string& filename) {
+  close();
+  if (!mFile.open(filename)) {
+    printf("Could not open network bundle %s.\n", filename.c_str());
+    return false;
+  }
+  if (mFile.size() < sizeof(TBundleHeader)) {
+    printf("Network bundle %s is truncated.\n", filename.c_str());
+    close();
+    return false;
+  }
+  const TBundleHeader* header = (const TBundleHeader*)mFile.data();
+  if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != BUNDLE_VERSION || header->headerBytes != sizeof(TBundleHeader)) {
+    printf("%s is not a version %d network bundle.\n", filename.c_str(), BUNDLE_VERSION);
+    close();
+    return false;
+  }
+  if (header->namesOffset + header->namesBytes > header->matrixOffset ||
+      (header->layout != kDenseLayout && header->layout != kPackedLayout && header->layout != kFactorLayout &&
+       header->layout != kHalfLayout && header->layout != kInt8Layout) ||
+      header->matrixBytes != layoutBytes(header->numNodes, (TSimilarityLayout)header->layout, header->rank) ||
+      header->matrixOffset + header->matrixBytes > mFile.size()) {
+    printf("Network bundle %s is truncated or corrupt.\n", filename.c_str());
+    close();
+    return false;
+  }
+  mHeader = header;
+
+  // Pull out the name table
+  const char* p = mFile.data() + mHeader->namesOffset;
+  const char* const end = p + mHeader->namesBytes;
+  mGenes.reserve(mHeader->numNodes);
+  while (p < end && (uint64_t)mGenes.size() < mHeader->numNodes) {
+    const size_t len = strnlen(p, end - p);
+    mGenes.add(std::string(p, len));
+    p += len + 1;
+  }
+  if ((uint64_t)mGenes.size() != mHeader->numNodes) {
+    printf("Network bundle %s has a damaged name table.\n", filename.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+void NetworkBundle::close(void) {
+  mFile.close();
+  mHeader = 0;
+  mGenes.clear();
+}
+
+bool NetworkBundle::verifyChecksum(void) const {
+  if (mHeader == 0) {
+    return false;
+  }
+  BundleChecksum checksum;
+  checksum.update(mFile.data() + mHeader->namesOffset, mHeader->namesBytes);
+  checksum.update(matrix(), mHeader->matrixBytes);
+  return checksum.value() == mHeader->checksum;
+}
+
+SimilarityMatrix* NetworkBundle::similarities(void) const {
+  const int n = numNodes();
+  const char* const data = mFile.data() + mHeader->matrixOffset;
+  switch (layout()) {
+  case kPackedLayout:
+    return new PackedSimilarities(matrix(), n);
+  case kFactorLayout:
+    return new FactorSimilarities(matrix(), n, rank());
+  case kHalfLayout:
+    return new HalfSimilarities((const uint16_t*)data, n);
+  case kInt8Layout: {
+    const float* const scales = (const float*)(data + int8ScalesOffset(n));
+    return new Int8Similarities((const int8_t*)data, scales, scales + n, n);
+  }
+  default:
+    return new DenseSimilarities(matrix(), n);
+  }
+}
+
+// Copies the rows and columns of indices out of any layout.
+class TCopySubmatrix {
+ public:
+ TCopySubmatrix(const std::vector<int>& indices, float* const mat, const int width)
+   : mIndices(indices), mMat(mat), mWidth(width) {}
+  template <typename M>
+  bool operator()(const M& full) {
+    float* curr_mat(mMat);
+    for (auto const row : mIndices) {
+      gatherSimilarities(full, row, mIndices.data(), mIndices.size(), curr_mat);
+      curr_mat += mWidth;
+    }
+    return true;
+  }
+  bool operator()(const FactorSimilarities& full) {
+    std::vector<float> block(mIndices.size() * mIndices.size());
+    if (!mIndices.empty()) {
+      full.block(mIndices, &block[0]);
+    }
+    for (size_t i = 0; i < mIndices.size(); ++i) {
+      std::copy(&block[i * mIndices.size()], &block[(i + 1) * mIndices.size()], mMat + i * mWidth);
+    }
+    return true;
+  }
+ private:
+  const std::vector<int>& mIndices;
+  float* const mMat;
+  const int mWidth;
+};
+
+bool readEntriesFromBundle(const NetworkBundle& bundle, const GeneDictionary& fullMap, const std::vector<std::string>& entries, GeneDictionary& newNameMap, float* const mat, const int width) {
+  // Same row/column order as readEntriesFromNetwork: sorted full indices.
+  std::vector<int> indices;
+  entryIndices(fullMap, entries, indices);
+
+  std::unique_ptr<SimilarityMatrix> full(bundle.similarities());
+  TCopySubmatrix copy(indices, mat, width);
+  dispatchSimilarities(*full, copy);
+
+  mapExtractedEntries(fullMap, indices, indices.size(), newNameMap);
+  return true;
+}
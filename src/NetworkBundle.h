@@ -0,0 +1,117 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** NetworkBundle.h
+** Binary, memory-mappable container for a similarity matrix.
+**
+** A bundle is a single file:
+**   TBundleHeader
+**   gene names, each NUL terminated, in matrix order
+**   zero padding up to the next page boundary
+**   the matrix, row-major: numNodes * numNodes floats for kDenseLayout,
+**   numNodes * (numNodes + 1) / 2 floats for the kPackedLayout triangle,
+**   numNodes * rank floats for kFactorLayout, numNodes * numNodes halves for
+**   kHalfLayout, or for kInt8Layout numNodes * numNodes signed bytes, zero
+**   padding to a multiple of 8 bytes, then numNodes row scales and the
+**   numNodes diagonal values as floats
+**
+** The checksum covers the name table and the matrix. It is written by the
+** converter and only checked on request, since hashing the whole matrix
+** would cost as much as reading it.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef NETWORKBUNDLE_H
+#define NETWORKBUNDLE_H
+
+#include "coreroutines.h"
+#include "MappedFile.h"
+#include <cstdio>
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "PRMSBNDL"
+#define BUNDLE_VERSION 2
+#define BUNDLE_ALIGNMENT 4096
+
+struct TBundleHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerBytes;
+  uint32_t layout;
+  // Columns per row of a low-rank factor; 0 for a full matrix.
+  uint32_t rank;
+  uint64_t numNodes;
+  uint64_t namesOffset;
+  uint64_t namesBytes;
+  uint64_t matrixOffset;
+  uint64_t matrixBytes;
+  uint64_t checksum;
+};
+
+// Running checksum over byte ranges fed in order.
+class BundleChecksum {
+ public:
+  BundleChecksum(void) : mHash(14695981039346656037ULL) {}
+  void update(const void* data, size_t bytes);
+  uint64_t value(void) const { return mHash; }
+ private:
+  uint64_t mHash;
+};
+
+// Writes a bundle row by row so the full matrix never has to be in memory.
+class NetworkBundleWriter {
+ public:
+  NetworkBundleWriter(void) : mFile(0), mRowsWritten(0) {}
+  ~NetworkBundleWriter(void);
+
+  bool begin(const std::string& filename, const std::vector<std::string>& names,
+	     const TSimilarityLayout layout = kDenseLayout, const int rank = 0);
+  // Takes a full row; packed bundles keep only its upper-triangle part, and
+  // a factor's rows have rank values. Half and int8 bundles round the row.
+  bool writeRow(const float* row);
+  bool finish(void);
+
+ private:
+  FILE* mFile;
+  TBundleHeader mHeader;
+  BundleChecksum mChecksum;
+  uint64_t mRowsWritten;
+  // Int8 rows' scales and diagonal values, written after the last row.
+  std::vector<float> mScales;
+  std::vector<float> mDiagonal;
+};
+
+// Read-only view of a bundle on disk. The matrix is never copied.
+class NetworkBundle {
+ public:
+  NetworkBundle(void) : mHeader(0) {}
+
+  bool open(const std::string& filename);
+  void close(void);
+  bool verifyChecksum(void) const;
+
+  int numNodes(void) const { return (int)mHeader->numNodes; }
+  TSimilarityLayout layout(void) const { return (TSimilarityLayout)mHeader->layout; }
+  int rank(void) const { return (int)mHeader->rank; }
+  uint64_t matrixBytes(void) const { return mHeader->matrixBytes; }
+  const float* matrix(void) const { return (const float*)(mFile.data() + mHeader->matrixOffset); }
+  // A view of the matrix in its layout, owned by the caller.
+  SimilarityMatrix* similarities(void) const;
+  const std::vector<std::string>& names(void) const { return mGenes.names(); }
+  const GeneDictionary& genes(void) const { return mGenes; }
+
+ private:
+  MappedFile mFile;
+  const TBundleHeader* mHeader;
+  GeneDictionary mGenes;
+};
+
+bool isNetworkBundle(const std::string& filename);
+bool writeNetworkBundle(const std::string& filename, const std::vector<std::string>& names, const float* const mat,
+			const TSimilarityLayout layout = kDenseLayout);
+bool readEntriesFromBundle(const NetworkBundle& bundle, const GeneDictionary& fullMap, const std::vector<std::string>& entries, GeneDictionary& newNameMap, float* const mat, const int width);
+
+#endif
@@ -0,0 +1,204 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** OnDemandKernel.cpp
+** Conjugate gradient solves for kernel rows, and their cache.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "OnDemandKernel.h"
+#include "coreroutines.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cmath>
+
+// Stop once the residual is this small; the initial residual e_g has norm
+// one, and kernel values are written as floats anyway.
+static const double kTolerance = 1e-8;
+static const int kMaxIterations = 10000;
+
+OnDemandKernel::OnDemandKernel(const NetworkAdjacency& adj, const float alpha, const size_t cacheBytes)
+  : mAdj(adj), mAlpha(alpha), mClock(0), mUnconverged(0)
+{
+  const int n = adj.numNodes();
+  mDiagonal.resize(n);
+  for (int i = 0; i < n; ++i) {
+    double degree = 0.0;
+    for (size_t k = adj.rowBegin(i); k < adj.rowEnd(i); ++k) {
+      degree += adj.weight(k);
+    }
+    mDiagonal[i] = 1.0 + mAlpha * degree;
+  }
+  const size_t rows = std::max((size_t)1, cacheBytes / (sizeof(float) * std::max(n, 1)));
+  mSlots.assign(std::min(rows, (size_t)std::max(n, 1)), -1);
+  mUsed.assign(mSlots.size(), 0);
+  mRows.resize(mSlots.size() * n);
+}
+
+void OnDemandKernel::multiply(const std::vector<double>& x, std::vector<double>& y) const {
+  const int n = mAdj.numNodes();
+  for (int i = 0; i < n; ++i) {
+    double sum = 0.0;
+    for (size_t k = mAdj.rowBegin(i); k < mAdj.rowEnd(i); ++k) {
+      // Like reglaplacian, a self-loop only counts towards the degree.
+      const int j = mAdj.column(k);
+      if (j != i) {
+	sum += mAdj.weight(k) * x[j];
+      }
+    }
+    y[i] = mDiagonal[i] * x[i] - mAlpha * sum;
+  }
+}
+
+// I + alpha * L is symmetric positive definite for non-negative weights.
+// The diagonal, 1 + alpha * degree, is used as the preconditioner, which
+// evens out the spread of degrees in scale-free networks.
+bool OnDemandKernel::solve(const int g, float* const out, TSolveWork& work) const {
+  const int n = mAdj.numNodes();
+  std::vector<double>& x = work.x;
+  std::vector<double>& r = work.r;
+  std::vector<double>& z = work.z;
+  std::vector<double>& p = work.p;
+  std::vector<double>& q = work.q;
+  x.assign(n, 0.0);
+  r.assign(n, 0.0);
+  z.resize(n);
+  p.assign(n, 0.0);
+  q.resize(n);
+  r[g] = 1.0;
+  p[g] = 1.0 / mDiagonal[g];
+  double rz = p[g];
+
+  bool converged = false;
+  for (int iteration = 0; iteration < kMaxIterations && !converged; ++iteration) {
+    multiply(p, q);
+    double pq = 0.0;
+    for (int i = 0; i < n; ++i) {
+      pq += p[i] * q[i];
+    }
+    const double a = rz / pq;
+    double rr = 0.0, rzNext = 0.0;
+    for (int i = 0; i < n; ++i) {
+      x[i] += a * p[i];
+      r[i] -= a * q[i];
+      z[i] = r[i] / mDiagonal[i];
+      rr += r[i] * r[i];
+      rzNext += r[i] * z[i];
+    }
+    converged = std::sqrt(rr) <= kTolerance;
+    const double beta = rzNext / rz;
+    rz = rzNext;
+    for (int i = 0; i < n; ++i) {
+      p[i] = z[i] + beta * p[i];
+    }
+  }
+  std::copy(x.begin(), x.end(), out);
+  return converged;
+}
+
+int OnDemandKernel::insert(const int g) {
+  int s = 0;
+  for (size_t k = 1; k < mSlots.size(); ++k) {
+    if (mUsed[k] < mUsed[s]) {
+      s = k;
+    }
+  }
+  if (mSlots[s] >= 0) {
+    mWhere.erase(mSlots[s]);
+  }
+  mSlots[s] = g;
+  mUsed[s] = ++mClock;
+  mWhere[g] = s;
+  return s;
+}
+
+const float* OnDemandKernel::row(const int g) {
+  const size_t n = mAdj.numNodes();
+  auto found = mWhere.find(g);
+  if (found != mWhere.end()) {
+    mUsed[found->second] = ++mClock;
+    return &mRows[found->second * n];
+  }
+  const int s = insert(g);
+  TSolveWork work;
+  if (!solve(g, &mRows[s * n], work)) {
+    mUnconverged++;
+  }
+  return &mRows[s * n];
+}
+
+// Rows are handed out to the threads one at a time; each solve takes the
+// same few sparse products, so they balance without any planning.
+void OnDemandKernel::prefetch(const std::vector<int>& genes, int numThreads) {
+  const size_t n = mAdj.numNodes();
+  std::vector<int> wanted;
+  std::vector<int> slots;
+  for (auto const g : genes) {
+    if ((int)wanted.size() == capacity()) {
+      break;
+    }
+    auto found = mWhere.find(g);
+    if (found != mWhere.end()) {
+      mUsed[found->second] = ++mClock;
+    } else if (std::find(wanted.begin(), wanted.end(), g) == wanted.end()) {
+      wanted.push_back(g);
+    }
+  }
+  for (auto const g : wanted) {
+    slots.push_back(insert(g));
+  }
+
+  if (numThreads <= 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  numThreads = std::max(1, std::min(numThreads, (int)wanted.size()));
+  std::atomic<size_t> next(0);
+  std::atomic<int> unconverged(0);
+  auto worker = [&]() {
+    TSolveWork work;
+    for (size_t k = next++; k < wanted.size(); k = next++) {
+      if (!solve(wanted[k], &mRows[slots[k] * n], work)) {
+	unconverged++;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < numThreads; ++t) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+  mUnconverged += unconverged;
+}
+
+bool readEntriesFromKernel(OnDemandKernel& kernel, const GeneDictionary& fullMap,
+			   const std::vector<std::string>& entries, GeneDictionary& newNameMap,
+			   float* const mat, const int width, const int numThreads) {
+  // Same row/column order as readEntriesFromNetwork: sorted full indices.
+  std::vector<int> indices;
+  entryIndices(fullMap, entries, indices);
+
+  // Solve as many rows at once as the cache holds, then copy them out.
+  for (size_t first = 0; first < indices.size(); first += kernel.capacity()) {
+    const size_t last = std::min(indices.size(), first + kernel.capacity());
+    kernel.prefetch(std::vector<int>(indices.begin() + first, indices.begin() + last), numThreads);
+    for (size_t i = first; i < last; ++i) {
+      const float* row = kernel.row(indices[i]);
+      for (size_t j = 0; j < indices.size(); ++j) {
+	mat[i * width + j] = row[indices[j]];
+      }
+    }
+  }
+
+  mapExtractedEntries(fullMap, indices, indices.size(), newNameMap);
+  if (kernel.numUnconverged() > 0) {
+    std::cerr << kernel.numUnconverged() << " kernel rows did not converge." << std::endl;
+  }
+  return true;
+}
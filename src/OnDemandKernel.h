@@ -0,0 +1,76 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** OnDemandKernel.h
+** Rows of the regularized Laplacian kernel (I + alpha * L)^-1 of a sparse
+** network, computed only when they are asked for. Row g is the solution of
+** (I + alpha * L) x = e_g, found by conjugate gradients with products
+** against the sparse matrix alone, so neither the dense kernel nor its file
+** is ever needed. Solved rows are kept in a least recently used cache.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef ONDEMANDKERNEL_H
+#define ONDEMANDKERNEL_H
+
+#include "EdgeList.h"
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <stdint.h>
+
+class OnDemandKernel {
+ public:
+  // The adjacency must outlive the kernel. cacheBytes bounds the memory for
+  // solved rows; at least one row is always kept.
+  OnDemandKernel(const NetworkAdjacency& adj, const float alpha, const size_t cacheBytes);
+
+  int numNodes(void) const { return mAdj.numNodes(); }
+  // Rows that can be cached at once.
+  int capacity(void) const { return (int)mSlots.size(); }
+  // Solves that stopped before reaching the tolerance.
+  int numUnconverged(void) const { return mUnconverged; }
+
+  // Row g of the kernel, solved unless it is cached. The pointer is valid
+  // until the next call to row() or prefetch().
+  const float* row(const int g);
+  // Solve those of the rows that are not cached on numThreads threads (0:
+  // every core). Only the first capacity() genes are kept.
+  void prefetch(const std::vector<int>& genes, int numThreads = 0);
+
+ private:
+  OnDemandKernel(const OnDemandKernel&);
+  OnDemandKernel& operator=(const OnDemandKernel&);
+
+  struct TSolveWork {
+    std::vector<double> x, r, z, p, q;
+  };
+  // Preconditioned conjugate gradients for row g, into out. Returns false if
+  // the iteration limit was reached first.
+  bool solve(const int g, float* const out, TSolveWork& work) const;
+  // y = (I + alpha * L) x
+  void multiply(const std::vector<double>& x, std::vector<double>& y) const;
+  // The slot for row g, evicting the least recently used row if needed.
+  int insert(const int g);
+
+  const NetworkAdjacency& mAdj;
+  const double mAlpha;
+  std::vector<double> mDiagonal;
+  std::vector<float> mRows;
+  std::vector<int> mSlots;
+  std::vector<uint64_t> mUsed;
+  std::unordered_map<int, int> mWhere;
+  uint64_t mClock;
+  int mUnconverged;
+};
+
+// As readEntriesFromBundle, with the values computed from the sparse network
+// on numThreads threads (0: every core).
+bool readEntriesFromKernel(OnDemandKernel& kernel, const GeneDictionary& fullMap,
+			   const std::vector<std::string>& entries, GeneDictionary& newNameMap,
+			   float* const mat, const int width, const int numThreads = 0);
+
+#endif
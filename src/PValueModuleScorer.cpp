@@ -68,7 +68,8 @@ void PValueModuleScorer::ShuffleGroups(const TIndicesGroups& groups, const std::
 
 
 
-void pullOutSubMatrix(const float* const similarities, const int width, std::vector<int>& indices, float* const newMatrix, std::map<int, int>& newIndexMap) {
+template <typename M>
+void pullOutSubMatrix(const M& similarities, std::vector<int>& indices, float* const newMatrix, std::map<int, int>& newIndexMap) {
   // Sort indices from least to greatest
   std::sort(indices.begin(), indices.end());
   const int n = indices.size();
@@ -76,10 +77,9 @@ void pullOutSubMatrix(const float* const similarities, const int width, std::vec
   
   // Pull out submatrix
   for (auto i : indices) {
-    const float* curr = similarities + width * i;
     int col = 0;
     for (auto j : indices) {
-      wcurr[col++] = curr[j];
+      wcurr[col++] = similarities(i, j);
     }
     wcurr += n;
   }
@@ -100,8 +100,10 @@ void populateNullDistribution(const int numIterations, std::vector<float>& value
 
 }
 
-bool PValueModuleScorer::ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
+bool PValueModuleScorer::ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups, const TIndices& indicesToScore, TScoreMap& scores) const
 {
+  const int width = similarities.width();
+
   // Seed the random number generator.
   std::srand(std::time(0));
   
@@ -159,17 +161,17 @@ bool PValueModuleScorer::ScoreModule(const float* const similarities, const int
       std::vector<int> flattenedIndices;
       flattenGroups(shuffledGroups, flattenedIndices);
       std::map<int, int> indexMap;
-      pullOutSubMatrix(similarities, width, flattenedIndices, subMatrix, indexMap);
+      pullOutSubMatrix(static_cast<const DenseSimilarities&>(similarities), flattenedIndices, subMatrix, indexMap);
 
       // Map new indices
       TIndicesGroups newGroups;
       mapGroupsToIndices(shuffledGroups, indexMap, newGroups);
       TIndices newInds;
       flattenGroups(newGroups, newInds);
-      mScorer->ScoreModule(subMatrix, n, newGroups, newInds, temp);
+      mScorer->ScoreModule(DenseSimilarities(subMatrix, n), newGroups, newInds, temp);
       
 #else
-      mScorer->ScoreModule(similarities, width, shuffledGroups, g.second, temp);
+      mScorer->ScoreModule(similarities, shuffledGroups, g.second, temp);
 #endif
       for (auto const i : g.second) {
 #if TEMP_BUFFER
@@ -182,7 +184,7 @@ bool PValueModuleScorer::ScoreModule(const float* const similarities, const int
   }
 
   TScoreMap real;
-  mScorer->ScoreModule(similarities, width, groups, indicesToScore, real);
+  mScorer->ScoreModule(similarities, groups, indicesToScore, real);
   for (auto const &item : allScores) {
     float myScore(real[item.first]);
 #define ZSCORE 0
@@ -242,7 +244,7 @@ void bonferroniCorrection(const TScoreMap& pvals, TScoreMap& pvalAdjusted) {
   }
 }
 
-void PValueModuleScorer::BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::ostream& out) const
+void PValueModuleScorer::BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const
 {
   std::vector<std::pair<int, float> > pairs;
 #if ZSCORE
@@ -265,14 +267,14 @@ void PValueModuleScorer::BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap,
   int i = 0;
   for (auto it = pairs.begin(); it != pairs.end() && i < 10; it++, i++) {
 #if ZSCORE
-    out << rmap[it->first] << "\t" << it->second << "\t" << pvals[it->first] << "\t" << pvalsAdjusted[it->first] << std::endl;
+    out << genes.name(it->first) << "\t" << it->second << "\t" << pvals[it->first] << "\t" << pvalsAdjusted[it->first] << std::endl;
 #else
-    out << rmap[it->first] << "\t" << it->second << "\t" << pvalsAdjusted[it->first] << std::endl;
+    out << genes.name(it->first) << "\t" << it->second << "\t" << pvalsAdjusted[it->first] << std::endl;
 #endif
   }
 }
 
-void PValueModuleScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TIndicesGroups& groups, std::ostream& out) const
+void PValueModuleScorer::LongSummary(TScoreMap& scores, const GeneDictionary& genes, const TIndicesGroups& groups, std::ostream& out) const
 {
 #if ZSCORE
   TScoreMap pvals, pvalsAdjusted;
@@ -310,9 +312,9 @@ void PValueModuleScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap,
 #endif
     for (auto const &e : pairs) {
 #if ZSCORE
-      out << rmap[e.first] << "\t" << e.second << "\t" << pvals[e.first] << "\t" << pvalsAdjusted[e.first] << std::endl;
+      out << genes.name(e.first) << "\t" << e.second << "\t" << pvals[e.first] << "\t" << pvalsAdjusted[e.first] << std::endl;
 #else
-      out << rmap[e.first] << "\t" << e.second << "\t" << pvalsAdjusted[e.first] << std::endl;
+      out << genes.name(e.first) << "\t" << e.second << "\t" << pvalsAdjusted[e.first] << std::endl;
 #endif
     }
     l++;
@@ -333,7 +335,7 @@ void PValueModuleScorer::LongSummary(TScoreMap& scores, TReverseIndexMap& rmap,
   std::vector<std::pair<int, float> > pairs;
   sortMapByVal(pvals, pairs, pvalCompare);
   for (auto const &e : pairs) {
-    out << groupMap[e.first] << "\t" << rmap[e.first] << "\t" << pvals[e.first] << "\t" << pvalsAdjusted[e.first] << std::endl;
+    out << groupMap[e.first] << "\t" << genes.name(e.first) << "\t" << pvals[e.first] << "\t" << pvalsAdjusted[e.first] << std::endl;
   }
     
   
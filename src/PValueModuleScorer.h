@@ -25,10 +25,10 @@ class PValueModuleScorer : public IModuleScorer {
     delete mScorer;
   }
   
-  bool ScoreModule(const float* const similarities, const int width, const TIndicesGroups& groups,
+  bool ScoreModule(const SimilarityMatrix& similarities, const TIndicesGroups& groups,
 		   const TIndices& indicesToScore, TScoreMap& scores) const;
-  void BriefSummary(TScoreMap& scores, TReverseIndexMap& rmap, std::ostream& out) const;
-  void LongSummary(TScoreMap& scores, TReverseIndexMap& rmap, const TIndicesGroups& groups, std::ostream& out) const;
+  void BriefSummary(TScoreMap& scores, const GeneDictionary& genes, std::ostream& out) const;
+  void LongSummary(TScoreMap& scores, const GeneDictionary& genes, const TIndicesGroups& groups, std::ostream& out) const;
   void ShuffleGroups(const TIndicesGroups& groups, const std::vector<int>& excisedIndicies, TIndicesGroups& shuffledGroups) const;
   
  private:
@@ -0,0 +1,105 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** QuantizedSimilarities.cpp
+** Widening gathers for the fp16 and int8 layouts.
+**
+** As in ScoreKernels.cpp, the F16C and AVX2 versions carry per-function
+** target attributes and are picked at run time, so the default build has
+** them too. Every version returns the same floats: half to float is exact,
+** and int8 values are scale * q in all of them.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "../include/SimilarityMatrix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANTIZED_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*THalfGather)(const uint16_t* row, const int* columns, int n, float* out);
+typedef void (*TInt8Gather)(const int8_t* row, float scale, const int* columns, int n, float* out);
+
+static void gatherHalfPlain(const uint16_t* const row, const int* const columns, const int n, float* const out) {
+  for (int k = 0; k < n; ++k) {
+    out[k] = halfToFloat(row[columns[k]]);
+  }
+}
+
+static void gatherInt8Plain(const int8_t* const row, const float scale, const int* const columns, const int n,
+			    float* const out) {
+  for (int k = 0; k < n; ++k) {
+    out[k] = scale * row[columns[k]];
+  }
+}
+
+#ifdef QUANTIZED_X86
+
+__attribute__((target("f16c")))
+static void gatherHalfF16c(const uint16_t* const row, const int* const columns, const int n, float* const out) {
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    const int* const c = columns + k;
+    const __m128i h = _mm_setr_epi16(row[c[0]], row[c[1]], row[c[2]], row[c[3]],
+				     row[c[4]], row[c[5]], row[c[6]], row[c[7]]);
+    _mm256_storeu_ps(out + k, _mm256_cvtph_ps(h));
+  }
+  gatherHalfPlain(row, columns + k, n - k, out + k);
+}
+
+__attribute__((target("avx2")))
+static void gatherInt8Avx2(const int8_t* const row, const float scale, const int* const columns, const int n,
+			   float* const out) {
+  const __m256 vscale = _mm256_set1_ps(scale);
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    const int* const c = columns + k;
+    const __m128i b = _mm_setr_epi8(row[c[0]], row[c[1]], row[c[2]], row[c[3]],
+				    row[c[4]], row[c[5]], row[c[6]], row[c[7]],
+				    0, 0, 0, 0, 0, 0, 0, 0);
+    _mm256_storeu_ps(out + k, _mm256_mul_ps(vscale, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(b))));
+  }
+  gatherInt8Plain(row, scale, columns + k, n - k, out + k);
+}
+
+#endif
+
+static THalfGather chooseHalfGather(void) {
+#ifdef QUANTIZED_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("f16c")) {
+    return gatherHalfF16c;
+  }
+#endif
+  return gatherHalfPlain;
+}
+
+static TInt8Gather chooseInt8Gather(void) {
+#ifdef QUANTIZED_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return gatherInt8Avx2;
+  }
+#endif
+  return gatherInt8Plain;
+}
+
+void HalfSimilarities::gather(const int i, const int* const columns, const int n, float* const out) const {
+  static const THalfGather widen = chooseHalfGather();
+  widen(mData + (size_t)mWidth * i, columns, n, out);
+}
+
+void Int8Similarities::gather(const int i, const int* const columns, const int n, float* const out) const {
+  static const TInt8Gather widen = chooseInt8Gather();
+  widen(mData + (size_t)mWidth * i, mScales[i], columns, n, out);
+  // The row's byte for the diagonal was read like any other.
+  for (int q = 0; q < n; ++q) {
+    if (columns[q] == i) {
+      out[q] = mDiagonal[i];
+    }
+  }
+}
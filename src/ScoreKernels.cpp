@@ -0,0 +1,205 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** ScoreKernels.cpp
+** Plain, AVX2 and AVX-512 versions of the scorers' inner loops.
+**
+** The vector versions are compiled with per-function target attributes, so
+** the rest of the program needs no -mavx2 or -march flags. min and max
+** follow the scalar (a < b) ? a : b and (a > b) ? a : b exactly.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "ScoreKernels.h"
+#include <cfloat>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCORE_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+static inline float minf(const float a, const float b) { return (a < b) ? a : b; }
+static inline float maxf(const float a, const float b) { return (a > b) ? a : b; }
+
+template <int M>
+static float maxSetPlain(const float a, const float d, const float* b, const float* const* c, const int n) {
+  float best(-FLT_MAX);
+  for (int k = 0; k < n; ++k) {
+    float curr = a + b[k];
+    if (M > 1) {
+      curr += d;
+    }
+    for (int i = 0; i < M; ++i) {
+      curr += c[i][k];
+    }
+    best = maxf(curr, best);
+  }
+  return best;
+}
+
+template <int M>
+static float maxSetClampedPlain(const float a, const float* me, const float* b, const float* const* c, const int n) {
+  float best(-FLT_MAX);
+  for (int k = 0; k < n; ++k) {
+    float curr = a + b[k];
+    for (int i = 0; i < M; ++i) {
+      curr += minf(minf(c[i][k], me[i]), b[k]);
+    }
+    best = maxf(curr, best);
+  }
+  return best;
+}
+
+#ifdef SCORE_KERNELS_X86
+
+__attribute__((target("avx2")))
+static float reduceMax(const __m256 v, float best) {
+  float lanes[8];
+  _mm256_storeu_ps(lanes, v);
+  for (int i = 0; i < 8; ++i) {
+    best = maxf(lanes[i], best);
+  }
+  return best;
+}
+
+template <int M>
+__attribute__((target("avx2")))
+static float maxSetAvx2(const float a, const float d, const float* b, const float* const* c, const int n) {
+  const __m256 va = _mm256_set1_ps(a);
+  const __m256 vd = _mm256_set1_ps(d);
+  __m256 best = _mm256_set1_ps(-FLT_MAX);
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 curr = _mm256_add_ps(va, _mm256_loadu_ps(b + k));
+    if (M > 1) {
+      curr = _mm256_add_ps(curr, vd);
+    }
+    for (int i = 0; i < M; ++i) {
+      curr = _mm256_add_ps(curr, _mm256_loadu_ps(c[i] + k));
+    }
+    best = _mm256_max_ps(curr, best);
+  }
+  const float* rest[M];
+  for (int i = 0; i < M; ++i) {
+    rest[i] = c[i] + k;
+  }
+  return maxf(maxSetPlain<M>(a, d, b + k, rest, n - k), reduceMax(best, -FLT_MAX));
+}
+
+template <int M>
+__attribute__((target("avx2")))
+static float maxSetClampedAvx2(const float a, const float* me, const float* b, const float* const* c, const int n) {
+  const __m256 va = _mm256_set1_ps(a);
+  __m256 best = _mm256_set1_ps(-FLT_MAX);
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    const __m256 vb = _mm256_loadu_ps(b + k);
+    __m256 curr = _mm256_add_ps(va, vb);
+    for (int i = 0; i < M; ++i) {
+      curr = _mm256_add_ps(curr, _mm256_min_ps(_mm256_min_ps(_mm256_loadu_ps(c[i] + k), _mm256_set1_ps(me[i])), vb));
+    }
+    best = _mm256_max_ps(curr, best);
+  }
+  const float* rest[M];
+  for (int i = 0; i < M; ++i) {
+    rest[i] = c[i] + k;
+  }
+  return maxf(maxSetClampedPlain<M>(a, me, b + k, rest, n - k), reduceMax(best, -FLT_MAX));
+}
+
+// GCC 12 warns, wrongly, that the undefined source register inside
+// _mm512_min_ps and _mm512_max_ps may be used uninitialized.
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static float reduceMax(const __m512 v, float best) {
+  float lanes[16];
+  _mm512_storeu_ps(lanes, v);
+  for (int i = 0; i < 16; ++i) {
+    best = maxf(lanes[i], best);
+  }
+  return best;
+}
+
+template <int M>
+__attribute__((target("avx512f")))
+static float maxSetAvx512(const float a, const float d, const float* b, const float* const* c, const int n) {
+  const __m512 va = _mm512_set1_ps(a);
+  const __m512 vd = _mm512_set1_ps(d);
+  __m512 best = _mm512_set1_ps(-FLT_MAX);
+  int k = 0;
+  for (; k + 16 <= n; k += 16) {
+    __m512 curr = _mm512_add_ps(va, _mm512_loadu_ps(b + k));
+    if (M > 1) {
+      curr = _mm512_add_ps(curr, vd);
+    }
+    for (int i = 0; i < M; ++i) {
+      curr = _mm512_add_ps(curr, _mm512_loadu_ps(c[i] + k));
+    }
+    best = _mm512_max_ps(curr, best);
+  }
+  const float* rest[M];
+  for (int i = 0; i < M; ++i) {
+    rest[i] = c[i] + k;
+  }
+  return maxf(maxSetAvx2<M>(a, d, b + k, rest, n - k), reduceMax(best, -FLT_MAX));
+}
+
+template <int M>
+__attribute__((target("avx512f")))
+static float maxSetClampedAvx512(const float a, const float* me, const float* b, const float* const* c, const int n) {
+  const __m512 va = _mm512_set1_ps(a);
+  __m512 best = _mm512_set1_ps(-FLT_MAX);
+  int k = 0;
+  for (; k + 16 <= n; k += 16) {
+    const __m512 vb = _mm512_loadu_ps(b + k);
+    __m512 curr = _mm512_add_ps(va, vb);
+    for (int i = 0; i < M; ++i) {
+      curr = _mm512_add_ps(curr, _mm512_min_ps(_mm512_min_ps(_mm512_loadu_ps(c[i] + k), _mm512_set1_ps(me[i])), vb));
+    }
+    best = _mm512_max_ps(curr, best);
+  }
+  const float* rest[M];
+  for (int i = 0; i < M; ++i) {
+    rest[i] = c[i] + k;
+  }
+  return maxf(maxSetClampedAvx2<M>(a, me, b + k, rest, n - k), reduceMax(best, -FLT_MAX));
+}
+
+#endif
+
+static TScoreKernels chooseKernels(void) {
+  TScoreKernels plain = {
+    { 0, maxSetPlain<1>, maxSetPlain<2>, maxSetPlain<3>, maxSetPlain<4>, maxSetPlain<5>, maxSetPlain<6> },
+    { 0, maxSetClampedPlain<1>, maxSetClampedPlain<2>, maxSetClampedPlain<3>, maxSetClampedPlain<4>,
+      maxSetClampedPlain<5>, maxSetClampedPlain<6> },
+    "plain" };
+#ifdef SCORE_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    TScoreKernels avx512 = {
+      { 0, maxSetAvx512<1>, maxSetAvx512<2>, maxSetAvx512<3>, maxSetAvx512<4>, maxSetAvx512<5>, maxSetAvx512<6> },
+      { 0, maxSetClampedAvx512<1>, maxSetClampedAvx512<2>, maxSetClampedAvx512<3>, maxSetClampedAvx512<4>,
+	maxSetClampedAvx512<5>, maxSetClampedAvx512<6> },
+      "AVX-512" };
+    return avx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    TScoreKernels avx2 = {
+      { 0, maxSetAvx2<1>, maxSetAvx2<2>, maxSetAvx2<3>, maxSetAvx2<4>, maxSetAvx2<5>, maxSetAvx2<6> },
+      { 0, maxSetClampedAvx2<1>, maxSetClampedAvx2<2>, maxSetClampedAvx2<3>, maxSetClampedAvx2<4>,
+	maxSetClampedAvx2<5>, maxSetClampedAvx2<6> },
+      "AVX2" };
+    return avx2;
+  }
+#endif
+  return plain;
+}
+
+const TScoreKernels& scoreKernels(void) {
+  static const TScoreKernels kernels = chooseKernels();
+  return kernels;
+}
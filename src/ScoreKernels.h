@@ -0,0 +1,40 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** ScoreKernels.h
+** The innermost loops of the complete graph scorers: the best score over
+** the last group's nodes, given the similarities to them gathered into
+** arrays. Each kernel adds terms in the same order as the scalar loops it
+** replaces, so results do not depend on the instruction set.
+**
+** Versions for AVX2 (8 nodes at a time) and AVX-512 (16) are built
+** alongside the plain one and the best the processor supports is picked
+** at run time, so one binary runs on every machine.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef SCOREKERNELS_H
+#define SCOREKERNELS_H
+
+// Largest clique scored, the candidate included.
+const int kMaxSetSize = 8;
+
+// Indexed by m, the number of nodes already chosen (1 .. kMaxSetSize - 2),
+// each with an array c[i] of its similarities to the last group's nodes.
+struct TScoreKernels {
+  // max over k < n of ((((a + b[k]) + d) + c[0][k]) + ...) + c[m - 1][k];
+  // d is left out when m is 1.
+  float (*maxSet[kMaxSetSize - 1])(float a, float d, const float* b, const float* const* c, int n);
+  // max over k < n of ((a + b[k]) + min(c[0][k], me[0], b[k]) + ...) + min(c[m - 1][k], me[m - 1], b[k])
+  float (*maxSetClamped[kMaxSetSize - 1])(float a, const float* me, const float* b, const float* const* c, int n);
+  const char* name;
+};
+
+// The kernels for this processor, chosen on first use. Every maximum is
+// -FLT_MAX when n is 0.
+const TScoreKernels& scoreKernels(void);
+
+#endif
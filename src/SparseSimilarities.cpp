@@ -0,0 +1,95 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** SparseSimilarities.cpp
+** This file implements the sparse similarity matrix builder.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#include "SparseSimilarities.h"
+#include <algorithm>
+
+// Orders entries so that the weakest is at the front of a heap.
+static bool strongerEntry(const std::pair<int, float>& a, const std::pair<int, float>& b) {
+  return a.second > b.second;
+}
+
+static bool lowerColumn(const std::pair<int, float>& a, const std::pair<int, float>& b) {
+  return a.first < b.first;
+}
+
+SparseSimilaritiesBuilder::SparseSimilaritiesBuilder(const int width, const int topK, const float minSimilarity)
+  : mWidth(width), mTopK(topK), mMinSimilarity(minSimilarity), mRows(width) {
+}
+
+void SparseSimilaritiesBuilder::addRow(const int row, const float* const values) {
+  if (row < 0 || row >= mWidth) {
+    return;
+  }
+  TRowEntries& kept = mRows[row];
+  kept.clear();
+  for (int j = 0; j < mWidth; ++j) {
+    const float v = values[j];
+    if (j == row || !(v >= mMinSimilarity)) {
+      continue;
+    }
+    if (mTopK <= 0) {
+      kept.push_back(std::make_pair(j, v));
+    } else if ((int)kept.size() < mTopK) {
+      kept.push_back(std::make_pair(j, v));
+      std::push_heap(kept.begin(), kept.end(), strongerEntry);
+    } else if (v > kept.front().second) {
+      std::pop_heap(kept.begin(), kept.end(), strongerEntry);
+      kept.back() = std::make_pair(j, v);
+      std::push_heap(kept.begin(), kept.end(), strongerEntry);
+    }
+  }
+  kept.push_back(std::make_pair(row, values[row]));
+  std::sort(kept.begin(), kept.end(), lowerColumn);
+  TRowEntries(kept).swap(kept);
+}
+
+SparseSimilarities* SparseSimilaritiesBuilder::finish(const float missingValue) {
+  // Pairs kept only by the other gene are added to this gene's row with the
+  // other gene's value.
+  std::vector<TRowEntries> incoming(mWidth);
+  for (int i = 0; i < mWidth; ++i) {
+    for (auto const &entry : mRows[i]) {
+      if (entry.first != i) {
+	incoming[entry.first].push_back(std::make_pair(i, entry.second));
+      }
+    }
+  }
+
+  std::vector<size_t> rowStart(mWidth + 1, 0);
+  std::vector<int> columns;
+  std::vector<float> values;
+  for (int i = 0; i < mWidth; ++i) {
+    // incoming[i] is already sorted, since rows were walked in order.
+    const TRowEntries& own = mRows[i];
+    const TRowEntries& other = incoming[i];
+    TRowEntries::const_iterator a = own.begin(), b = other.begin();
+    while (a != own.end() || b != other.end()) {
+      if (b == other.end() || (a != own.end() && a->first <= b->first)) {
+	// A gene's own value wins when both kept the pair.
+	if (b != other.end() && a->first == b->first) {
+	  ++b;
+	}
+	columns.push_back(a->first);
+	values.push_back(a->second);
+	++a;
+      } else {
+	columns.push_back(b->first);
+	values.push_back(b->second);
+	++b;
+      }
+    }
+    rowStart[i + 1] = columns.size();
+    TRowEntries().swap(mRows[i]);
+    TRowEntries().swap(incoming[i]);
+  }
+  return new SparseSimilarities(mWidth, missingValue, rowStart, columns, values);
+}
@@ -0,0 +1,47 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** SparseSimilarities.h
+** Builds a SparseSimilarities matrix from full rows, keeping for every gene
+** only its strongest neighbors and/or the pairs above a threshold.
+**
+** Rows can be added from several threads, so the builder can be fed straight
+** from the parallel matrix parser. A pair is kept when either of its genes
+** kept it; the matrix is symmetrized on finish(). The diagonal is always
+** kept.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef SPARSESIMILARITIES_H
+#define SPARSESIMILARITIES_H
+
+#include "../include/SimilarityMatrix.h"
+#include "MatrixParser.h"
+#include <vector>
+#include <utility>
+#include <limits>
+
+class SparseSimilaritiesBuilder : public IMatrixRowSink {
+ public:
+  // topK <= 0 keeps every pair that passes minSimilarity.
+  SparseSimilaritiesBuilder(const int width, const int topK,
+			    const float minSimilarity = -std::numeric_limits<float>::infinity());
+
+  void addRow(const int row, const float* const values);
+  // Symmetrize the kept pairs into a new matrix owned by the caller. The
+  // builder is empty afterwards.
+  SparseSimilarities* finish(const float missingValue);
+
+ private:
+  typedef std::vector< std::pair<int, float> > TRowEntries;
+
+  const int mWidth;
+  const int mTopK;
+  const float mMinSimilarity;
+  std::vector<TRowEntries> mRows;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** ThreadPool.h
+** A fixed set of worker threads that run batches of independent tasks.
+** Scorers are called once per permutation in p-value runs, so the threads
+** are started once and kept waiting between batches instead of being
+** created for every call.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <stdint.h>
+
+class ThreadPool {
+ public:
+  // numThreads <= 0 uses every core. The calling thread is one of them.
+  explicit ThreadPool(int numThreads = 0) : mTask(0), mBatch(0), mRunning(0), mStop(false), mNumTasks(0) {
+    if (numThreads <= 0) {
+      numThreads = std::thread::hardware_concurrency();
+    }
+    numThreads = std::max(1, numThreads);
+    for (int t = 1; t < numThreads; ++t) {
+      mThreads.push_back(std::thread(&ThreadPool::work, this, t));
+    }
+  }
+
+  ~ThreadPool(void) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStop = true;
+    }
+    mWake.notify_all();
+    for (auto &t : mThreads) {
+      t.join();
+    }
+  }
+
+  int numThreads(void) const { return mThreads.size() + 1; }
+
+  // Call task(i, thread) for every i < numTasks and wait for all of them.
+  // Tasks are handed out one at a time, so uneven ones still balance;
+  // thread (0 .. numThreads() - 1) lets a task pick its own scratch space.
+  // Not reentrant: one batch runs at a time.
+  void run(size_t numTasks, const std::function<void(size_t, int)>& task) {
+    if (mThreads.empty() || numTasks <= 1) {
+      for (size_t i = 0; i < numTasks; ++i) {
+	task(i, 0);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mTask = &task;
+      mNumTasks = numTasks;
+      mNext = 0;
+      mRunning = mThreads.size();
+      mBatch++;
+    }
+    mWake.notify_all();
+    drain(0);
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock, [this]() { return mRunning == 0; });
+    mTask = 0;
+  }
+
+ private:
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  void drain(int thread) {
+    for (size_t i = mNext++; i < mNumTasks; i = mNext++) {
+      (*mTask)(i, thread);
+    }
+  }
+
+  void work(int thread) {
+    uint64_t seen(0);
+    for (;;) {
+      {
+	std::unique_lock<std::mutex> lock(mMutex);
+	mWake.wait(lock, [&]() { return mStop || mBatch != seen; });
+	if (mStop) {
+	  return;
+	}
+	seen = mBatch;
+      }
+      drain(thread);
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (--mRunning == 0) {
+	mDone.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> mThreads;
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mDone;
+  const std::function<void(size_t, int)>* mTask;
+  uint64_t mBatch;
+  int mRunning;
+  bool mStop;
+  size_t mNumTasks;
+  std::atomic<size_t> mNext;
+};
+
+#endif
@@ -0,0 +1,212 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** TileStore.h
+** The lower triangle of a symmetric matrix too large for memory, cut into
+** square tiles that live in a scratch file. A bounded number of tiles are
+** cached in memory and written back when they are evicted, least recently
+** used first.
+**
+** Tiles are tileSize x tileSize and column-major. Tile (i, j), i >= j, holds
+** rows i * tileSize on and columns j * tileSize on.
+**
+** Author: kca
+** -------------------------------------------------------------------------*/
+
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+
+template <typename T>
+class TileStore {
+ public:
+  TileStore(void) : mFd(-1), mNumTiles(0), mTileSize(0), mClock(0), mFailed(false) {}
+  ~TileStore(void) { close(); }
+
+  // Create the scratch file in directory for numTiles x numTiles tiles,
+  // caching at most numSlots of them. The file is unlinked straight away,
+  // so it disappears with the process however that ends. numSlots must
+  // exceed the number of tiles ever pinned at once.
+  bool open(const std::string& directory, int numTiles, int tileSize, size_t numSlots) {
+    close();
+    std::string path = (directory.empty() ? std::string(".") : directory) + "/promising_tilesXXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    mFd = mkstemp(&name[0]);
+    if (mFd < 0) {
+      return false;
+    }
+    unlink(&name[0]);
+    mNumTiles = numTiles;
+    mTileSize = tileSize;
+    const size_t total = (size_t)numTiles * (numTiles + 1) / 2;
+    mWritten.assign(total, false);
+    mSlots.assign(std::min(numSlots, total), Slot());
+    mMemory.assign(mSlots.size() * tileElements(), (T)0.0);
+    mWhere.clear();
+    mFailed = false;
+    return true;
+  }
+
+  void close(void) {
+    if (mFd >= 0) {
+      ::close(mFd);
+      mFd = -1;
+    }
+    std::vector<T>().swap(mMemory);
+    mSlots.clear();
+    mWhere.clear();
+  }
+
+  int numTiles(void) const { return mNumTiles; }
+  int tileSize(void) const { return mTileSize; }
+  // True once reading or writing the scratch file has failed.
+  bool failed(void) const { return mFailed; }
+
+  // Pin tile (i, j), i >= j, in memory and return it. A tile that was never
+  // written back is all zeros.
+  T* acquire(int i, int j) {
+    const size_t id = tileIndex(i, j);
+    auto found = mWhere.find(id);
+    int s;
+    if (found != mWhere.end()) {
+      s = found->second;
+    } else {
+      s = evict();
+      Slot& slot = mSlots[s];
+      slot.tile = id;
+      slot.dirty = false;
+      mWhere[id] = s;
+      T* data = slotData(s);
+      if (mWritten[id]) {
+	if (!transfer(id, data, false)) {
+	  mFailed = true;
+	}
+      } else {
+	std::fill(data, data + tileElements(), (T)0.0);
+      }
+    }
+    mSlots[s].pins++;
+    mSlots[s].used = ++mClock;
+    return slotData(s);
+  }
+
+  // Unpin a tile; dirty if it was changed and must be written back.
+  void release(int i, int j, bool dirty) {
+    Slot& slot = mSlots[mWhere[tileIndex(i, j)]];
+    slot.pins--;
+    slot.dirty = slot.dirty || dirty;
+  }
+
+  // Copy row r of the whole symmetric matrix, numTiles * tileSize values:
+  // the tile row left of the diagonal and the tile column below it. Safe to
+  // call from several threads.
+  void copyrow(int r, T* out) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const int b = mTileSize;
+    const int i = r / b;
+    const int rr = r % b;
+    for (int j = 0; j < mNumTiles; ++j) {
+      T* row = out + (size_t)j * b;
+      if (j < i) {
+	const T* t = acquire(i, j);
+	for (int c = 0; c < b; ++c) {
+	  row[c] = t[(size_t)c * b + rr];
+	}
+	release(i, j, false);
+      } else if (j > i) {
+	const T* t = acquire(j, i);
+	std::copy(t + (size_t)rr * b, t + (size_t)(rr + 1) * b, row);
+	release(j, i, false);
+      } else {
+	// Only the diagonal tile's lower triangle is kept.
+	const T* t = acquire(i, i);
+	for (int c = 0; c < b; ++c) {
+	  row[c] = (c <= rr) ? t[(size_t)c * b + rr] : t[(size_t)rr * b + c];
+	}
+	release(i, i, false);
+      }
+    }
+  }
+
+ private:
+  TileStore(const TileStore&);
+  TileStore& operator=(const TileStore&);
+
+  struct Slot {
+    Slot(void) : tile(kEmpty), pins(0), dirty(false), used(0) {}
+    size_t tile;
+    int pins;
+    bool dirty;
+    uint64_t used;
+  };
+  static const size_t kEmpty = (size_t)-1;
+
+  size_t tileElements(void) const { return (size_t)mTileSize * mTileSize; }
+  size_t tileIndex(int i, int j) const { return (size_t)i * (i + 1) / 2 + j; }
+  T* slotData(int s) { return &mMemory[(size_t)s * tileElements()]; }
+
+  // Free the least recently used slot that is not pinned, writing its tile
+  // back first if it changed.
+  int evict(void) {
+    int victim = -1;
+    for (size_t s = 0; s < mSlots.size(); ++s) {
+      if (mSlots[s].tile == kEmpty) {
+	return s;
+      }
+      if (mSlots[s].pins == 0 && (victim < 0 || mSlots[s].used < mSlots[victim].used)) {
+	victim = s;
+      }
+    }
+    Slot& slot = mSlots[victim];
+    if (slot.dirty) {
+      if (!transfer(slot.tile, slotData(victim), true)) {
+	mFailed = true;
+      }
+      mWritten[slot.tile] = true;
+    }
+    mWhere.erase(slot.tile);
+    slot = Slot();
+    return victim;
+  }
+
+  // Write a tile to, or read it from, its place in the scratch file.
+  bool transfer(size_t id, T* data, bool write) {
+    const size_t bytes = tileElements() * sizeof(T);
+    char* p = (char*)data;
+    off_t offset = (off_t)(id * bytes);
+    for (size_t done = 0; done < bytes; ) {
+      const ssize_t k = write ? pwrite(mFd, p + done, bytes - done, offset + done)
+	: pread(mFd, p + done, bytes - done, offset + done);
+      if (k <= 0) {
+	return false;
+      }
+      done += k;
+    }
+    return true;
+  }
+
+  int mFd;
+  int mNumTiles;
+  int mTileSize;
+  uint64_t mClock;
+  bool mFailed;
+  std::vector<T> mMemory;
+  std::vector<Slot> mSlots;
+  std::vector<bool> mWritten;
+  std::unordered_map<size_t, int> mWhere;
+  std::mutex mMutex;
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <tclap/CmdLine.h>
+
+struct TRanked {
+  std::vector<std::string> genes;
+  std::map<std::string, int> rank;
+  std::map<std::string, double> value;
+};
+
+// Read a promising output file: a header line, then locus, gene and score
+// (or p-value) per line, best first. A gene's rank is its line.
+bool readRanked(const std::string& filename, TRanked& ranked) {
+  std::ifstream in(filename.c_str());
+  std::string line;
+  if (!in.good() || !std::getline(in, line)) {
+    printf("Problem reading scores from file %s\n", filename.c_str());
+    return false;
+  }
+  while (std::getline(in, line)) {
+    std::stringstream ss(line);
+    std::string locus, gene, value;
+    if (!std::getline(ss, locus, '\t') || !std::getline(ss, gene, '\t') || !std::getline(ss, value, '\t')) {
+      continue;
+    }
+    if (ranked.rank.count(gene) == 0) {
+      ranked.rank[gene] = ranked.genes.size();
+      ranked.value[gene] = strtod(value.c_str(), 0);
+      ranked.genes.push_back(gene);
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  TCLAP::CmdLine cmd("Compare a promising ranking against a reference, such as one scored at full precision.", ' ', "0.9");
+  TCLAP::ValueArg<std::string> referenceFilename("r", "reference", "Reference output file (promising -o)", true, "", "string");
+  cmd.add(referenceFilename);
+  TCLAP::ValueArg<std::string> candidateFilename("c", "candidate", "Output file to compare", true, "", "string");
+  cmd.add(candidateFilename);
+  TCLAP::ValueArg<int> top("k", "top", "Size of the top of the ranking to compare", false, 10, "int");
+  cmd.add(top);
+
+  cmd.parse(argc, argv);
+
+  TRanked reference, candidate;
+  if (!readRanked(referenceFilename.getValue(), reference) ||
+      !readRanked(candidateFilename.getValue(), candidate)) {
+    return(-1);
+  }
+
+  // Genes in both files, with their ranks among those genes only.
+  std::vector<std::string> common;
+  for (auto const &g : reference.genes) {
+    if (candidate.rank.count(g) != 0) {
+      common.push_back(g);
+    }
+  }
+  std::vector<std::pair<int, std::string> > order;
+  for (auto const &g : common) {
+    order.push_back(std::make_pair(candidate.rank[g], g));
+  }
+  std::sort(order.begin(), order.end());
+  std::map<std::string, int> candidateRank;
+  for (size_t i = 0; i < order.size(); ++i) {
+    candidateRank[order[i].second] = i;
+  }
+
+  const size_t n = common.size();
+  double sumSquares(0.0), maxDifference(0.0);
+  int changed(0), maxShift(0);
+  std::string maxShiftGene;
+  for (size_t i = 0; i < n; ++i) {
+    const std::string& g = common[i];
+    const int shift = std::abs(candidateRank[g] - (int)i);
+    sumSquares += (double)shift * shift;
+    if (shift != 0) {
+      changed++;
+    }
+    if (shift > maxShift) {
+      maxShift = shift;
+      maxShiftGene = g;
+    }
+    maxDifference = std::max(maxDifference, std::fabs(reference.value[g] - candidate.value[g]));
+  }
+  const double spearman = (n > 1) ? 1.0 - 6.0 * sumSquares / ((double)n * ((double)n * n - 1.0)) : 1.0;
+
+  const size_t k = std::min((size_t)std::max(top.getValue(), 0), n);
+  int overlap(0);
+  bool sameOrder(true);
+  for (size_t i = 0; i < k; ++i) {
+    overlap += (candidateRank[common[i]] < (int)k) ? 1 : 0;
+    sameOrder = sameOrder && candidateRank[common[i]] == (int)i;
+  }
+
+  printf("%lu genes in both rankings; %lu only in the reference, %lu only in the candidate.\n",
+	 n, reference.genes.size() - n, candidate.genes.size() - n);
+  printf("Largest difference in value: %g\n", maxDifference);
+  printf("Spearman rank correlation: %.6f\n", spearman);
+  printf("Genes whose rank changed: %d\n", changed);
+  if (maxShift > 0) {
+    printf("Largest rank change: %d (%s)\n", maxShift, maxShiftGene.c_str());
+  }
+  printf("Top %lu: %d in common, %s order.\n", k, overlap, sameOrder ? "same" : "different");
+  return 0;
+}
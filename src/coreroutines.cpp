@@ -10,6 +10,7 @@
 ** -------------------------------------------------------------------------*/
 
 #include "coreroutines.h"
+#include "MatrixParser.h"
 #include <algorithm>
 #include <sstream>
 #include <iostream>
@@ -32,7 +33,7 @@ static inline std::string &trim(std::string &s) {
   return ltrim(rtrim(s));
 }
 
-int parseNamesLine(const std::string line, TIndexMap& map) {
+int parseNamesLine(const std::string line, GeneDictionary& map) {
   std::string entry;
   int i = 0;
   auto start = 0;
@@ -40,90 +41,107 @@ int parseNamesLine(const std::string line, TIndexMap& map) {
   while (end != std::string::npos) {
     std::string s = line.substr(start, end - start);
     s = trim(s);
-    map[s] = i++;
-    //rmap[i] = s;
+    map.add(s);
+    i++;
     start = end + 1;
     end = line.find("\t", start);
   }
   std::string s = line.substr(start, line.back()-start);
   s = trim(s);
-  map[s] = i++;
-  //  rmap[i] = s;
+  map.add(s);
+  i++;
   
   return i;
 }
 
-bool readEntireNetwork(std::ifstream& matFile, const int numNodes, float* const mat) {
+int parseNamesLine(const std::string line, std::vector<std::string>& names) {
+  GeneDictionary map;
+  const int n = parseNamesLine(line, map);
+  names = map.names();
+  return n;
+}
+
+// Parse up to numNodes values from one matrix line. Returns the number read.
+int parseMatrixRow(const std::string& line, const int numNodes, float* const row) {
+  return parseMatrixLine(line.data(), line.data() + line.size(), numNodes, row);
+}
+
+bool readEntireNetwork(std::istream& matFile, const int numNodes, float* const mat) {
   float* curr(mat);
   std::string line;
   int row(0);
   while (!matFile.eof() && row < numNodes) {
-    int col(0);
-    float v;
     std::getline(matFile, line);
-    std::stringstream stream(line);
-    while ((stream >> v) && col < numNodes) {
-      curr[col] = v;
-      col++;
-    }
+    parseMatrixRow(line, numNodes, curr);
     curr += numNodes;
     row++;
   }
   return true;
 }
 
-bool readEntriesFromNetwork(std::ifstream& matFile, TIndexMap& fullMap, const std::vector<std::string>& entries, TIndexMap& newNameMap, float* const mat, const int width) {
+// Keep only the upper triangle of each row, diagonal included, packed row
+// after row (see PackedSimilarities).
+bool readEntireNetworkPacked(std::istream& matFile, const int numNodes, float* const packed) {
+  std::vector<float> rowBuffer(numNodes, 0.0f);
+  float* curr(packed);
+  std::string line;
+  int row(0);
+  while (!matFile.eof() && row < numNodes) {
+    std::getline(matFile, line);
+    // Like readEntireNetwork, leave entries past a short row untouched.
+    const int numRead = parseMatrixRow(line, numNodes, &rowBuffer[0]);
+    if (numRead > row) {
+      std::copy(rowBuffer.begin() + row, rowBuffer.begin() + numRead, curr);
+    }
+    curr += numNodes - row;
+    row++;
+  }
+  return true;
+}
 
-  // Get values
-  std::vector<int> indices;
+void entryIndices(const GeneDictionary& fullMap, const std::vector<std::string>& entries, std::vector<int>& indices) {
   for (auto const &s: entries) {
-    if (fullMap.find(s) != fullMap.end()) {
-      indices.push_back(fullMap[s]);
+    const int id = fullMap.find(s);
+    if (id >= 0) {
+      indices.push_back(id);
     }
   }
-
-  float* curr_mat(mat);
   std::sort(indices.begin(), indices.end());
   indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+}
+
+void mapExtractedEntries(const GeneDictionary& fullMap, const std::vector<int>& indices, const int numRows, GeneDictionary& newNameMap) {
+  newNameMap.clear();
+  newNameMap.reserve(numRows);
+  for (int i = 0; i < numRows; ++i) {
+    newNameMap.add(fullMap.name(indices[i]));
+  }
+}
+
+bool readEntriesFromNetwork(std::istream& matFile, const GeneDictionary& fullMap, const std::vector<std::string>& entries, GeneDictionary& newNameMap, float* const mat, const int width) {
+
+  // Get values
+  std::vector<int> indices;
+  entryIndices(fullMap, entries, indices);
+
+  float* curr_mat(mat);
   std::vector<int>::const_iterator itrow = indices.begin();
-  std::map<int, int> newIndexMapping;
-  int row = 0, ii = 0, nextRow = *itrow;
+  int row = 0, ii = 0;
 
   std::string line;
   while (!matFile.eof() && itrow != indices.end()) {
     std::getline(matFile, line);
-    if (row == nextRow) {
-      std::vector<int>::const_iterator curr_col = indices.begin();
-      int nextCol(*curr_col);
-      std::stringstream stream(line);
-      float v;
-      int col = 0, colNew = 0;
-      while ((stream >> v) && curr_col != indices.end()) {
-	if (col == nextCol) {
-	  curr_mat[colNew++] = v;
-	  curr_col++;
-	  nextCol = *curr_col;
-	}
-	col++;
-      }
+    if (row == *itrow) {
+      parseMatrixColumns(line.data(), line.data() + line.size(), indices, curr_mat);
       curr_mat += width;
-      newIndexMapping[row] = ii++;
+      ii++;
       itrow++;
-      nextRow = *itrow;
     }
     row++;
   }
 
-  // Add entries for new index mapping
-  for (auto const &entry : entries) {
-    if (fullMap.find(entry) != fullMap.end()) {
-      int v = fullMap[entry];
-      if (newIndexMapping.find(v) != newIndexMapping.end()) {
-	int vv = newIndexMapping[v];
-	newNameMap[entry] = vv;
-      }
-    }
-  }
+  // Rows are read in order, so the first ii wanted rows were found.
+  mapExtractedEntries(fullMap, indices, ii, newNameMap);
   
   return true;
 }
@@ -228,6 +246,20 @@ bool readGMT(std::ifstream& gmtStream, TGroups& groups) {
 //   }
 // }
 
+void mapGroupsToIndices(const TGroups& groups, const GeneDictionary& map, TIndicesGroups& indicesGroups)
+{
+  for (auto const &g : groups) {
+    std::vector<int>& inds = indicesGroups[g.first];
+    inds.clear();
+    for (auto const &e : g.second) {
+      const int id = map.find(e);
+      if (id >= 0) {
+	inds.push_back(id);
+      }
+    }
+  }
+}
+
 void printMatrix(const float* buffer, const int rows, const int cols) {
   const float* v = buffer;
   for (int y = 0; y < rows; ++y) {
@@ -13,6 +13,7 @@
 #define COREROUTINES_H
 
 #include "../include/IModuleScorer.h"
+#include "../include/GeneDictionary.h"
 #include <fstream>
 #include <iostream>
 #include <vector>
@@ -20,21 +21,53 @@
 #include <string>
 #include <algorithm>
 
-typedef std::map<std::string, int> TIndexMap;
 //typedef std::vector< std::vector<std::string> > TGroups;
 typedef std::map<std::string, std::vector<std::string> > TGroups;
 
-int parseNamesLine(const std::string line, TIndexMap& map);
-bool readEntriesFromNetwork(std::ifstream& matFile, TIndexMap& fullMap, const std::vector<std::string>& entries, TIndexMap& newNameMap, float* const mat, const int width);
-bool readEntireNetwork(std::ifstream& matFile, const int numNodes, float* const mat);
+int parseNamesLine(const std::string line, GeneDictionary& map);
+int parseNamesLine(const std::string line, std::vector<std::string>& names);
+int parseMatrixRow(const std::string& line, const int numNodes, float* const row);
+void entryIndices(const GeneDictionary& fullMap, const std::vector<std::string>& entries, std::vector<int>& indices);
+// newNameMap gets the names of the first numRows of the sorted indices, so
+// that a gene's id is its row in the extracted matrix.
+void mapExtractedEntries(const GeneDictionary& fullMap, const std::vector<int>& indices, const int numRows, GeneDictionary& newNameMap);
+bool readEntriesFromNetwork(std::istream& matFile, const GeneDictionary& fullMap, const std::vector<std::string>& entries, GeneDictionary& newNameMap, float* const mat, const int width);
+bool readEntireNetwork(std::istream& matFile, const int numNodes, float* const mat);
+bool readEntireNetworkPacked(std::istream& matFile, const int numNodes, float* const packed);
 //bool readGroups(std::ifstream& groupFile, TGroups& groups);
 bool readGMT(std::ifstream& gmtFile, TGroups& groups);
 void flattenGroups(const TGroups& groups, std::vector<std::string>& entries);
-void mapGroupsToIndices(const TGroups& groups, TIndexMap& map, TIndicesGroups& indicesGroups);
+void mapGroupsToIndices(const TGroups& groups, const GeneDictionary& map, TIndicesGroups& indicesGroups);
 void printMatrix(const float* buffer, const int rows, const int cols);
 float phi(float x);
 void comb(int N, int K, std::vector< std::vector<int> >& combinations);
 
+// The same combinations as comb(), in the same order, stepped through in
+// place in c[0..K-1]: firstCombination sets up the first one and
+// nextCombination moves to the next. Both return false when there are no
+// more.
+inline bool firstCombination(const int N, const int K, int* const c) {
+  for (int i = 0; i < K; ++i) {
+    c[i] = i;
+  }
+  return K <= N;
+}
+
+inline bool nextCombination(const int N, const int K, int* const c) {
+  int i = K - 1;
+  while (i >= 0 && c[i] == N - K + i) {
+    --i;
+  }
+  if (i < 0) {
+    return false;
+  }
+  ++c[i];
+  for (int j = i + 1; j < K; ++j) {
+    c[j] = c[j - 1] + 1;
+  }
+  return true;
+}
+
 template <typename T> void printGroups(const std::vector< std::vector<T> >& groups) {
   for (auto const &g : groups) {
     for (auto item : g) {
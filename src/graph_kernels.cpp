@@ -1,204 +1,1523 @@
 #include <stdio.h>
 #include <cstring>
 #include <string>
-#include <map>
-#include <utility>
 #include <sstream>
+#include <fstream>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <memory>
 #include <tclap/CmdLine.h>
 
-typedef std::map< std::pair< std::string, std::string >, float> NetMap;
-typedef std::map<std::string, int> IndexMap;
+#include "EdgeList.h"
+#include "CompressedStream.h"
+#include "NetworkBundle.h"
+#include "LapackRoutines.h"
+#include "TileStore.h"
+#include "MatrixParser.h"
+#include "SimilarityMatrix.h"
 
-extern "C" {
-    // LU decomoposition of a general matrix
-    void sgetrf_(int* M, int *N, float* A, int* lda, int* IPIV, int* INFO);
-
-    // generate inverse of a matrix given its LU decomposition
-    void sgetri_(int* N, float* A, int* lda, int* IPIV, float* WORK, int* lwork, int* INFO);
-}
-
-void inverse(float* A, int N)
+template <typename T>
+bool inverse(T* A, int N)
 {
     int *IPIV = new int[N+1];
     int LWORK = N*N;
-    float *WORK = new float[LWORK];
+    T *WORK = new T[LWORK];
     int INFO;
 
-    sgetrf_(&N,&N,A,&N,IPIV,&INFO);
-    sgetri_(&N,A,&N,IPIV,WORK,&LWORK,&INFO);
+    getrf(&N,A,IPIV,&INFO);
+    if (INFO == 0) {
+      getri(&N,A,IPIV,WORK,&LWORK,&INFO);
+    }
 
     delete [] IPIV;
     delete [] WORK;
+    return INFO == 0;
 }
 
-void laplacian(float* a, int n) {
-  float* ptr(a);
-  for (int i = 0; i < n; ++i, ptr += n) {
-    float acc = 0.0;
+// Copy the upper triangle (row-major) onto the lower one, a tile at a time.
+template <typename T>
+void mirrorupper(T* a, const int n) {
+  const int tile = 64;
+  for (int ib = 0; ib < n; ib += tile) {
+    for (int jb = ib; jb < n; jb += tile) {
+      const int iend = std::min(ib + tile, n);
+      const int jend = std::min(jb + tile, n);
+      for (int i = ib; i < iend; ++i) {
+	for (int j = std::max(jb, i + 1); j < jend; ++j) {
+	  a[(size_t)j * n + i] = a[(size_t)i * n + j];
+	}
+      }
+    }
+  }
+}
+
+// Invert a symmetric positive definite matrix in place with a Cholesky
+// factorization. Only one triangle is used and no workspace is needed; the
+// result is mirrored to fill the whole matrix. Returns false if the matrix is
+// not positive definite, in which case it has been overwritten.
+template <typename T>
+bool inverseSPD(T* a, int n) {
+  // Column-major lower is row-major upper; the matrix is symmetric anyway.
+  char uplo = 'L';
+  int info;
+  potrf(&uplo, &n, a, &info);
+  if (info != 0) {
+    return false;
+  }
+  potri(&uplo, &n, a, &info);
+  if (info != 0) {
+    return false;
+  }
+  mirrorupper(a, n);
+  return true;
+}
+
+// The kernel of one connected component: its nodes (global indices, in
+// increasing order) and the dense m x m kernel among them. For an alpha
+// sweep, the eigenvalues and eigenvectors of the component's Laplacian are
+// kept as well.
+template <typename T>
+struct KernelBlock {
+  std::vector<int> nodes;
+  std::vector<T> mat;
+  std::vector<T> values;
+  std::vector<T> vectors;
+  // With --genes, the local indices of the requested genes; mat then holds
+  // only their kernel columns, m x requested.size() column-major.
+  std::vector<int> requested;
+  // Out of core, the full kernel is kept in the tiles of a scratch file
+  // instead of mat.
+  std::shared_ptr< TileStore<T> > tiles;
+};
+
+static int findroot(std::vector<int>& parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// Split the network into its connected components. component[i] is the block
+// holding node i and local[i] is its position within that block. Components
+// are numbered in order of their lowest node index.
+template <typename T>
+void connectedcomponents(const NetworkAdjacency& adj, std::vector<int>& component,
+			 std::vector<int>& local, std::vector< KernelBlock<T> >& blocks) {
+  const int n = adj.numNodes();
+  std::vector<int> parent(n);
+  for (int i = 0; i < n; ++i) {
+    parent[i] = i;
+  }
+  for (int i = 0; i < n; ++i) {
+    for (size_t k = adj.rowBegin(i); k < adj.rowEnd(i); ++k) {
+      const int r1 = findroot(parent, i);
+      const int r2 = findroot(parent, adj.column(k));
+      if (r1 != r2) {
+	parent[std::max(r1, r2)] = std::min(r1, r2);
+      }
+    }
+  }
+
+  component.assign(n, -1);
+  local.assign(n, 0);
+  blocks.clear();
+  for (int i = 0; i < n; ++i) {
+    const int root = findroot(parent, i);
+    if (component[root] < 0) {
+      component[root] = blocks.size();
+      blocks.push_back(KernelBlock<T>());
+    }
+    const int c = component[root];
+    component[i] = c;
+    local[i] = blocks[c].nodes.size();
+    blocks[c].nodes.push_back(i);
+  }
+}
+
+enum TBlockFill {
+  kAdjacencyFill,
+  kLaplacianFill,
+  kRegularizedFill
+};
+
+// Fill a block straight from the sparse rows with its component's adjacency
+// matrix A, its Laplacian L = D - A, or I + alpha * L.
+template <typename T>
+void populateblock(const NetworkAdjacency& adj, const std::vector<int>& local,
+		   TBlockFill fill, T alpha, KernelBlock<T>& block) {
+  const size_t m = block.nodes.size();
+  block.mat.assign(m * m, (T)0.0);
+  const T scale = (fill == kAdjacencyFill) ? 1.0 : (fill == kLaplacianFill) ? -1.0 : -alpha;
+  for (size_t li = 0; li < m; ++li) {
+    const int i = block.nodes[li];
+    T* row = &block.mat[li * m];
+    T degree = 0.0;
+    for (size_t k = adj.rowBegin(i); k < adj.rowEnd(i); ++k) {
+      const T w = adj.weight(k);
+      degree += w;
+      row[local[adj.column(k)]] = scale * w;
+    }
+    if (fill == kLaplacianFill) {
+      row[li] = degree;
+    } else if (fill == kRegularizedFill) {
+      row[li] = 1.0 + alpha * degree;
+    }
+  }
+}
+
+// Replace a block with its regularized Laplacian kernel. I + alpha * L is
+// symmetric positive definite for non-negative edge weights, so it is
+// inverted with a Cholesky factorization; LU is the fallback otherwise.
+template <typename T>
+bool invertblock(const NetworkAdjacency& adj, const std::vector<int>& local,
+		 T alpha, KernelBlock<T>& block, bool& usedLU) {
+  const int m = block.nodes.size();
+  populateblock(adj, local, kRegularizedFill, alpha, block);
+  if (inverseSPD(&block.mat[0], m)) {
+    return true;
+  }
+  // The factorization overwrote the matrix; start again.
+  usedLU = true;
+  populateblock(adj, local, kRegularizedFill, alpha, block);
+  return inverse(&block.mat[0], m);
+}
+
+// Run f on every block. Blocks are independent, so they are handed out to
+// numThreads workers, largest first; the largest component dominates the
+// run time. Returns false as soon as f fails on any block.
+template <typename T, typename F>
+bool foreachblock(std::vector< KernelBlock<T> >& blocks, int numThreads, const F& f) {
+  std::vector<int> order(blocks.size());
+  for (size_t c = 0; c < blocks.size(); ++c) {
+    order[c] = c;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](int c1, int c2) {
+      return blocks[c1].nodes.size() > blocks[c2].nodes.size();
+    });
+
+  if (numThreads <= 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  numThreads = std::max(1, std::min(numThreads, (int)blocks.size()));
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    for (size_t k = next++; k < order.size() && !failed; k = next++) {
+      if (!f(blocks[order[k]])) {
+	failed = true;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < numThreads; ++t) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+  return !failed;
+}
+
+// Compute only the kernel columns of a block's requested genes: factor
+// I + alpha * L once and solve against the matching columns of the identity.
+// By symmetry, these columns are also the genes' kernel rows.
+template <typename T>
+bool solveblock(const NetworkAdjacency& adj, const std::vector<int>& local,
+		T alpha, KernelBlock<T>& block, bool invert, bool& usedLU) {
+  int m = block.nodes.size();
+  int k = block.requested.size();
+  std::vector<T> columns((size_t)m * k, (T)0.0);
+  populateblock(adj, local, invert ? kRegularizedFill : kAdjacencyFill, alpha, block);
+  if (!invert) {
+    for (int q = 0; q < k; ++q) {
+      const T* row = &block.mat[(size_t)block.requested[q] * m];
+      std::copy(row, row + m, &columns[(size_t)q * m]);
+    }
+    block.mat.swap(columns);
+    return true;
+  }
+
+  for (int q = 0; q < k; ++q) {
+    columns[(size_t)q * m + block.requested[q]] = 1.0;
+  }
+  char uplo = 'L';
+  int info;
+  potrf(&uplo, &m, &block.mat[0], &info);
+  if (info == 0) {
+    potrs(&uplo, &m, &k, &block.mat[0], &columns[0], &info);
+  } else {
+    // The factorization overwrote the matrix; start again with LU.
+    usedLU = true;
+    populateblock(adj, local, kRegularizedFill, alpha, block);
+    std::vector<int> ipiv(m);
+    getrf(&m, &block.mat[0], &ipiv[0], &info);
+    if (info == 0) {
+      getrs(&m, &k, &block.mat[0], &ipiv[0], &columns[0], &info);
+    }
+  }
+  block.mat.swap(columns);
+  return info == 0;
+}
+
+// Fill the lower triangle of I + alpha * L into the tiles, a tile column at
+// a time; node lj's sparse row is also its column. The padding past the
+// block's last node is the identity.
+template <typename T>
+void populatetiles(const NetworkAdjacency& adj, const std::vector<int>& local,
+		   T alpha, const KernelBlock<T>& block, TileStore<T>& tiles) {
+  const int m = block.nodes.size();
+  const int nt = tiles.numTiles();
+  const int b = tiles.tileSize();
+  std::vector<T*> column(nt);
+  for (int J = 0; J < nt; ++J) {
+    for (int I = J; I < nt; ++I) {
+      column[I] = tiles.acquire(I, J);
+    }
+    for (int c = 0; c < b; ++c) {
+      const int lj = J * b + c;
+      T* diagonal = &column[J][(size_t)c * b + c];
+      if (lj >= m) {
+	*diagonal = 1.0;
+	continue;
+      }
+      const int j = block.nodes[lj];
+      T degree = 0.0;
+      for (size_t k = adj.rowBegin(j); k < adj.rowEnd(j); ++k) {
+	const T w = adj.weight(k);
+	degree += w;
+	const int li = local[adj.column(k)];
+	if (li > lj) {
+	  column[li / b][(size_t)c * b + li % b] = -alpha * w;
+	}
+      }
+      *diagonal = 1.0 + alpha * degree;
+    }
+    for (int I = J; I < nt; ++I) {
+      tiles.release(I, J, true);
+    }
+  }
+}
+
+// Tiled Cholesky factorization A = L L^T in place, left-looking: each tile
+// column is updated with the factored columns to its left, then the
+// diagonal tile is factored and the tiles below it solved against it.
+// Returns false if the matrix is not positive definite.
+template <typename T>
+bool tiledcholesky(TileStore<T>& tiles) {
+  int nt = tiles.numTiles(), b = tiles.tileSize(), info = 0;
+  char lower = 'L', right = 'R', notrans = 'N', trans = 'T';
+  T one = 1.0, minusone = -1.0;
+  for (int J = 0; J < nt; ++J) {
+    for (int I = J; I < nt; ++I) {
+      T* a = tiles.acquire(I, J);
+      for (int K = 0; K < J; ++K) {
+	T* lik = tiles.acquire(I, K);
+	if (I == J) {
+	  syrk(&lower, &notrans, &b, &b, &minusone, lik, &one, a);
+	} else {
+	  T* ljk = tiles.acquire(J, K);
+	  gemm(&notrans, &trans, &b, &b, &b, &minusone, lik, ljk, &one, a);
+	  tiles.release(J, K, false);
+	}
+	tiles.release(I, K, false);
+      }
+      if (I == J) {
+	potrf(&lower, &b, a, &info);
+      } else {
+	T* ljj = tiles.acquire(J, J);
+	trsm(&right, &lower, &trans, &b, &b, &one, ljj, a);
+	tiles.release(J, J, false);
+      }
+      tiles.release(I, J, true);
+      if (info != 0) {
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Turn the tiled Cholesky factor L into the inverse (L L^T)^-1 = W^T W in
+// place, with W = L^-1, the way LAPACK's potri does: first W, one tile
+// column at a time from the right, then the lower triangle of W^T W, one
+// tile row at a time from the top. Each step only reads tiles that have not
+// been overwritten yet.
+template <typename T>
+bool tiledinverse(TileStore<T>& tiles) {
+  int nt = tiles.numTiles(), b = tiles.tileSize(), info = 0;
+  char lower = 'L', left = 'L', right = 'R', notrans = 'N', trans = 'T';
+  T one = 1.0, minusone = -1.0;
+
+  // W_IJ = -(W_II L_IJ + sum over J < K < I of W_IK L_KJ) L_JJ^-1
+  for (int J = nt - 1; J >= 0; --J) {
+    for (int I = nt - 1; I > J; --I) {
+      T* a = tiles.acquire(I, J);
+      T* wii = tiles.acquire(I, I);
+      trmm(&left, &lower, &notrans, &b, &b, &one, wii, a);
+      tiles.release(I, I, false);
+      for (int K = J + 1; K < I; ++K) {
+	T* wik = tiles.acquire(I, K);
+	T* lkj = tiles.acquire(K, J);
+	gemm(&notrans, &notrans, &b, &b, &b, &one, wik, lkj, &one, a);
+	tiles.release(K, J, false);
+	tiles.release(I, K, false);
+      }
+      T* ljj = tiles.acquire(J, J);
+      trsm(&right, &lower, &notrans, &b, &b, &minusone, ljj, a);
+      tiles.release(J, J, false);
+      tiles.release(I, J, true);
+    }
+    T* a = tiles.acquire(J, J);
+    trtri(&lower, &b, a, &info);
+    tiles.release(J, J, true);
+    if (info != 0) {
+      return false;
+    }
+  }
+
+  // (W^T W)_IJ = sum over K >= I of W_KI^T W_KJ
+  for (int I = 0; I < nt; ++I) {
+    for (int J = 0; J <= I; ++J) {
+      T* a = tiles.acquire(I, J);
+      if (J < I) {
+	T* wii = tiles.acquire(I, I);
+	trmm(&left, &lower, &trans, &b, &b, &one, wii, a);
+	tiles.release(I, I, false);
+      } else {
+	lauum(&lower, &b, a, &info);
+      }
+      for (int K = I + 1; K < nt; ++K) {
+	T* wki = tiles.acquire(K, I);
+	if (J < I) {
+	  T* wkj = tiles.acquire(K, J);
+	  gemm(&trans, &notrans, &b, &b, &b, &one, wki, wkj, &one, a);
+	  tiles.release(K, J, false);
+	} else {
+	  syrk(&lower, &trans, &b, &b, &one, wki, &one, a);
+	}
+	tiles.release(K, I, false);
+      }
+      tiles.release(I, J, true);
+    }
+  }
+  return info == 0;
+}
+
+// As solveblock, with the tiled Cholesky factor: the requested columns of
+// the identity are solved against L and then L^T, a tile row at a time.
+template <typename T>
+void tiledsolve(TileStore<T>& tiles, KernelBlock<T>& block) {
+  int nt = tiles.numTiles(), b = tiles.tileSize();
+  int k = block.requested.size();
+  const size_t m = block.nodes.size();
+  char lower = 'L', left = 'L', notrans = 'N', trans = 'T';
+  T one = 1.0, minusone = -1.0;
+  // panels[I] holds rows I * b on of the right-hand sides, b x k.
+  std::vector< std::vector<T> > panels(nt, std::vector<T>((size_t)b * k, (T)0.0));
+  for (int q = 0; q < k; ++q) {
+    const int r = block.requested[q];
+    panels[r / b][(size_t)q * b + r % b] = 1.0;
+  }
+  for (int I = 0; I < nt; ++I) {
+    for (int K = 0; K < I; ++K) {
+      T* lik = tiles.acquire(I, K);
+      gemm(&notrans, &notrans, &b, &k, &b, &minusone, lik, &panels[K][0], &one, &panels[I][0]);
+      tiles.release(I, K, false);
+    }
+    T* lii = tiles.acquire(I, I);
+    trsm(&left, &lower, &notrans, &b, &k, &one, lii, &panels[I][0]);
+    tiles.release(I, I, false);
+  }
+  for (int I = nt - 1; I >= 0; --I) {
+    for (int K = I + 1; K < nt; ++K) {
+      T* lki = tiles.acquire(K, I);
+      gemm(&trans, &notrans, &b, &k, &b, &minusone, lki, &panels[K][0], &one, &panels[I][0]);
+      tiles.release(K, I, false);
+    }
+    T* lii = tiles.acquire(I, I);
+    trsm(&left, &lower, &trans, &b, &k, &one, lii, &panels[I][0]);
+    tiles.release(I, I, false);
+  }
+  block.mat.resize(m * k);
+  for (int q = 0; q < k; ++q) {
+    for (size_t r = 0; r < m; ++r) {
+      block.mat[q * m + r] = panels[r / b][(size_t)q * b + r % b];
+    }
+  }
+}
+
+// Invert a block too large for the memory budget out of core. Tiles are
+// sized so that about three tile columns fit in the budget, which keeps a
+// tile row of the factor cached while the tiles next to it stream past.
+// The kernel stays in the scratch file and is read back a row at a time
+// when it is written; with --genes only the requested columns are solved
+// for and the scratch file is dropped.
+template <typename T>
+bool invertblocktiled(const NetworkAdjacency& adj, const std::vector<int>& local, T alpha,
+		      KernelBlock<T>& block, size_t memory, const std::string& scratch) {
+  const size_t m = block.nodes.size();
+  size_t b = memory / (3 * m * sizeof(T)) / 64 * 64;
+  b = std::max((size_t)64, std::min((size_t)4096, b));
+  const size_t nt = (m + b - 1) / b;
+  const size_t slots = memory / (b * b * sizeof(T));
+  if (slots < nt + 4) {
+    printf("A component of %lu genes needs --memory of at least %lu MB.\n",
+	   m, ((nt + 4) * b * b * sizeof(T) >> 20) + 1);
+    return false;
+  }
+  std::shared_ptr< TileStore<T> > tiles(new TileStore<T>());
+  if (!tiles->open(scratch, nt, b, slots)) {
+    printf("Problem creating a scratch file in %s\n", scratch.c_str());
+    return false;
+  }
+  printf("Inverting a component of %lu genes out of core, in %lu x %lu tiles of %lu.\n", m, nt, nt, b);
+
+  populatetiles(adj, local, alpha, block, *tiles);
+  bool ok = tiledcholesky(*tiles);
+  if (ok && !block.requested.empty()) {
+    tiledsolve(*tiles, block);
+  } else if (ok) {
+    ok = tiledinverse(*tiles);
+    block.tiles = tiles;
+  }
+  if (tiles->failed()) {
+    printf("Problem with the scratch file in %s\n", scratch.c_str());
+    return false;
+  }
+  if (!ok) {
+    printf("I + alpha * L is not positive definite, which --memory cannot handle.\n");
+  }
+  return ok;
+}
+
+// Build every block, and invert it unless only the adjacency matrix is
+// wanted. With subset, only the requested genes' columns are kept, and
+// components without any requested gene are skipped altogether. Blocks
+// whose kernel would take more than memory bytes (if not 0) are inverted
+// out of core, one at a time, with scratch files in the scratch directory.
+template <typename T>
+bool computeblocks(const NetworkAdjacency& adj, const std::vector<int>& local,
+		   std::vector< KernelBlock<T> >& blocks, bool invert, bool subset, T alpha, int numThreads,
+		   size_t memory, const std::string& scratch) {
+  auto tiled = [&](const KernelBlock<T>& block) {
+    const size_t m = block.nodes.size();
+    return invert && memory > 0 && m * m * sizeof(T) > memory;
+  };
+  for (auto &block : blocks) {
+    if (tiled(block) && !(subset && block.requested.empty()) &&
+	!invertblocktiled(adj, local, alpha, block, memory, scratch)) {
+      return false;
+    }
+  }
+
+  std::atomic<bool> usedLU(false);
+  const bool ok = foreachblock(blocks, numThreads, [&](KernelBlock<T>& block) {
+      if ((subset && block.requested.empty()) || tiled(block)) {
+	return true;
+      }
+      bool lu(false);
+      bool solved(true);
+      if (subset) {
+	solved = solveblock(adj, local, alpha, block, invert, lu);
+      } else if (invert) {
+	solved = invertblock(adj, local, alpha, block, lu);
+      } else {
+	populateblock(adj, local, kAdjacencyFill, alpha, block);
+      }
+      if (lu) {
+	usedLU = true;
+      }
+      return solved;
+    });
+
+  if (usedLU) {
+    printf("I + alpha * L is not positive definite; inverted with LU instead.\n");
+  }
+  if (!ok) {
+    printf("The regularized Laplacian is singular.\n");
+  }
+  return ok;
+}
+
+// Eigendecompose a block's Laplacian, L = V diag(values) V^T.
+template <typename T>
+bool eigendecomposeblock(const NetworkAdjacency& adj, const std::vector<int>& local,
+			 KernelBlock<T>& block) {
+  int m = block.nodes.size();
+  populateblock(adj, local, kLaplacianFill, (T)0.0, block);
+  block.values.resize(m);
+
+  // Workspace query, then the decomposition itself. Eigenvectors overwrite
+  // the matrix, one per column (column-major).
+  char jobz = 'V', uplo = 'L';
+  int lwork = -1, liwork = -1, info;
+  T worksize;
+  int iworksize;
+  syevd(&jobz, &uplo, &m, &block.mat[0], &block.values[0], &worksize, &lwork, &iworksize, &liwork, &info);
+  if (info != 0) {
+    return false;
+  }
+  lwork = (int)worksize;
+  liwork = iworksize;
+  std::vector<T> work(lwork);
+  std::vector<int> iwork(liwork);
+  syevd(&jobz, &uplo, &m, &block.mat[0], &block.values[0], &work[0], &lwork, &iwork[0], &liwork, &info);
+  if (info != 0) {
+    return false;
+  }
+  block.vectors.swap(block.mat);
+  return true;
+}
+
+// The eigenvalues of (I + alpha * L)^-1, 1 / (1 + alpha * values). Returns
+// false if the matrix is singular.
+template <typename T>
+bool kernelscales(T alpha, const KernelBlock<T>& block, std::vector<T>& scale, bool& positive) {
+  const int m = block.values.size();
+  scale.resize(m);
+  positive = true;
+  for (int k = 0; k < m; ++k) {
+    const T d = 1.0 + alpha * block.values[k];
+    if (d == 0.0) {
+      return false;
+    }
+    scale[k] = 1.0 / d;
+    positive = positive && d > 0.0;
+  }
+  return true;
+}
+
+// Rebuild a block's kernel (I + alpha * L)^-1 = V diag(1 / (1 + alpha * values)) V^T
+// from its eigendecomposition. When every scale is positive, the kernel is
+// W W^T with W = V diag(sqrt(scale)), and only one triangle is computed.
+template <typename T>
+bool reconstructblock(T alpha, KernelBlock<T>& block) {
+  int m = block.nodes.size();
+  std::vector<T> scale;
+  bool positive;
+  if (!kernelscales(alpha, block, scale, positive)) {
+    return false;
+  }
+
+  std::vector<T> w(block.vectors);
+  for (int k = 0; k < m; ++k) {
+    const T sk = positive ? std::sqrt(scale[k]) : scale[k];
+    T* col = &w[(size_t)k * m];
+    for (int i = 0; i < m; ++i) {
+      col[i] *= sk;
+    }
+  }
+  block.mat.resize((size_t)m * m);
+  T one = 1.0, zero = 0.0;
+  char notrans = 'N', trans = 'T';
+  if (positive) {
+    char uplo = 'L';
+    syrk(&uplo, &notrans, &m, &m, &one, &w[0], &zero, &block.mat[0]);
+    mirrorupper(&block.mat[0], m);
+  } else {
+    gemm(&notrans, &trans, &m, &m, &m, &one, &w[0], &block.vectors[0], &zero, &block.mat[0]);
+  }
+  return true;
+}
+
+// As reconstructblock, but only for the requested genes' columns:
+// V (diag(scale) V^T restricted to those columns).
+template <typename T>
+bool reconstructcolumns(T alpha, KernelBlock<T>& block) {
+  int m = block.nodes.size();
+  int k = block.requested.size();
+  std::vector<T> scale;
+  bool positive;
+  if (!kernelscales(alpha, block, scale, positive)) {
+    return false;
+  }
+
+  std::vector<T> w((size_t)m * k);
+  for (int q = 0; q < k; ++q) {
+    const int r = block.requested[q];
+    T* col = &w[(size_t)q * m];
+    for (int j = 0; j < m; ++j) {
+      col[j] = scale[j] * block.vectors[(size_t)j * m + r];
+    }
+  }
+  block.mat.resize((size_t)m * k);
+  T one = 1.0, zero = 0.0;
+  char notrans = 'N';
+  gemm(&notrans, &notrans, &m, &k, &m, &one, &block.vectors[0], &w[0], &zero, &block.mat[0]);
+  return true;
+}
+
+// The rows of the output, each assembled from the block holding its gene.
+// A row's entries follow the output column order; entries between different
+// components are zero. In the full kernel a gene's values are its row of
+// the block; with --genes they are the block column in its slot, which is
+// the same by symmetry.
+template <typename T>
+class KernelRows {
+ public:
+  KernelRows(const std::vector< KernelBlock<T> >& blocks, const std::vector<int>& component,
+	     const std::vector<int>& local, const std::vector<int>& order,
+	     const std::vector<int>& rows, const std::vector<int>& slot, bool subset)
+    : mBlocks(blocks), mComponent(component), mLocal(local), mOrder(order),
+      mRows(rows), mSlot(slot), mSubset(subset) {}
+
+  int numRows(void) const { return mRows.size(); }
+  int numColumns(void) const { return mOrder.size(); }
+
+  void fill(int r, T* out) const {
+    const int g = mRows[r];
+    const KernelBlock<T>& block = mBlocks[mComponent[g]];
+    const size_t m = block.nodes.size();
+    std::vector<T> tilerow;
+    const T* values;
+    if (block.tiles) {
+      tilerow.resize((size_t)block.tiles->numTiles() * block.tiles->tileSize());
+      block.tiles->copyrow(mLocal[g], &tilerow[0]);
+      values = &tilerow[0];
+    } else {
+      values = &block.mat[(mSubset ? mSlot[g] : mLocal[g]) * m];
+    }
+    const int n = mOrder.size();
     for (int j = 0; j < n; ++j) {
-      acc += ptr[j];
-      ptr[j] = -ptr[j];
+      const int h = mOrder[j];
+      out[j] = (mComponent[h] == mComponent[g]) ? values[mLocal[h]] : (T)0.0;
+    }
+  }
+
+ private:
+  const std::vector< KernelBlock<T> >& mBlocks;
+  const std::vector<int>& mComponent;
+  const std::vector<int>& mLocal;
+  const std::vector<int>& mOrder;
+  const std::vector<int>& mRows;
+  const std::vector<int>& mSlot;
+  const bool mSubset;
+};
+
+// Print the digits of q (the leading one worth 10^exponent) the way %g with
+// the given precision would, trailing zeros dropped.
+static int formatdigits(uint64_t q, int exponent, int precision, char* out) {
+  char digits[24];
+  int k = 0;
+  for (; q > 0; q /= 10) {
+    digits[k++] = '0' + q % 10;
+  }
+  std::reverse(digits, digits + k);
+  while (k > 1 && digits[k - 1] == '0') {
+    k--;
+  }
+
+  char* p = out;
+  if (exponent >= -4 && exponent < precision) {
+    if (exponent < 0) {
+      *p++ = '0';
+      *p++ = '.';
+      for (int i = -1; i > exponent; --i) {
+	*p++ = '0';
+      }
+      memcpy(p, digits, k);
+      p += k;
+    } else {
+      for (int i = 0; i <= exponent; ++i) {
+	*p++ = (i < k) ? digits[i] : '0';
+      }
+      if (k > exponent + 1) {
+	*p++ = '.';
+	memcpy(p, digits + exponent + 1, k - exponent - 1);
+	p += k - exponent - 1;
+      }
+    }
+  } else {
+    *p++ = digits[0];
+    if (k > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, k - 1);
+      p += k - 1;
+    }
+    p += sprintf(p, "e%c%02d", exponent < 0 ? '-' : '+', std::abs(exponent));
+  }
+  return p - out;
+}
+
+// Format v with the fewest significant digits that read back as the same
+// value. A value that needs at most 6 digits prints the same at 6 as at its
+// shortest, since %g drops trailing zeros, so the search starts there; 9
+// digits always suffice.
+//
+// Each candidate is v rounded to d digits, q * 10^s, worked out in double
+// precision. It reads back as v if it lies strictly between the midpoints
+// to v's neighbouring floats; those are exact in double. A candidate within
+// double rounding error of either one is left to printf.
+static int formatshortest(float v, char* out) {
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  if (v == 0.0f) {
+    out[0] = '0';
+    return 1;
+  }
+  const float a = std::fabs(v);
+  if (a >= 1e-15f && a < 1e27f) {
+    char* p = out;
+    if (v < 0.0f) {
+      *p++ = '-';
+    }
+    const double x = a;
+    const double lo = 0.5 * (x + (double)std::nextafter(a, 0.0f));
+    const double hi = 0.5 * (x + (double)std::nextafter(a, 2.0f * a));
+    uint32_t bits;
+    memcpy(&bits, &a, sizeof(bits));
+    const bool evenmantissa = (bits & 1) == 0;
+    int e = (int)std::floor(std::log10(x));
+    for (int d = 6; d <= 8; ++d) {
+      int s = e - d + 1;
+      double q = std::nearbyint((s >= 0) ? x / powers[s] : x * powers[-s]);
+      if (q >= powers[d]) {
+	// Rounded up to the next power of ten.
+	q /= 10.0;
+	s++;
+      } else if (q < powers[d - 1]) {
+	// log10 put the leading digit one place too high.
+	e--;
+	d--;
+	continue;
+      }
+      const double candidate = (s >= 0) ? q * powers[s] : q / powers[-s];
+      const double slack = candidate * 4e-16;
+      // Whole numbers whose product has no rounding error are exact, and can
+      // land on a midpoint; reading back breaks the tie towards the float
+      // with an even mantissa.
+      const bool exact = (s >= 0 && std::fma(q, powers[s], -candidate) == 0.0);
+      if (!exact && (std::fabs(candidate - lo) <= slack || std::fabs(hi - candidate) <= slack)) {
+	// Too close to call at d digits; more digits could miss the shortest.
+	break;
+      }
+      const bool inside = (lo < candidate && candidate < hi);
+      const bool tie = exact && evenmantissa && (candidate == lo || candidate == hi);
+      if (inside || tie) {
+	return (p - out) + formatdigits((uint64_t)q, s + d - 1, d, p);
+      }
     }
-    ptr[i] = acc;
   }
+  // Out of range of the table, or too close to call: search with printf.
+  int length = 0;
+  for (int digits = 6; digits <= 9; ++digits) {
+    length = snprintf(out, 32, "%.*g", digits, (double)v);
+    if (strtof(out, 0) == v) {
+      break;
+    }
+  }
+  return length;
 }
 
-void scalarmultiply(float scalar, float* a, int n) {
-  for (int i = 0; i < n*n; ++i) {
-    a[i] = a[i] * scalar;
+static int formatshortest(double v, char* out) {
+  if (v == 0.0) {
+    out[0] = '0';
+    return 1;
   }
+  int length = 0;
+  for (int digits = 15; digits <= 17; ++digits) {
+    length = snprintf(out, 32, "%.*g", digits, v);
+    if (strtod(out, 0) == v) {
+      break;
+    }
+  }
+  return length;
 }
 
-void regularizedlaplacian(float alpha, float* a, int n) {
-  laplacian(a, n);
-  scalarmultiply(alpha, a, n);
-  // Add identity
-  float* ptr(a);
-  for (int i = 0; i < n; ++i, ptr += n) {
-    ptr[i] = ptr[i] + 1.0f;
+// Write the rows as tab-delimited text. Rows are formatted in batches, each
+// thread filling its own reusable buffer with a run of rows, and the
+// buffers are written out in order.
+template <typename T>
+bool writetextrows(const KernelRows<T>& rows, FILE* f, int numThreads) {
+  if (numThreads <= 0) {
+    numThreads = std::thread::hardware_concurrency();
   }
-  inverse(a, n);
+  numThreads = std::max(1, numThreads);
+  const int n = rows.numColumns();
+  const int rowsPerThread = 16;
+  std::vector< std::vector<char> > buffers(numThreads);
+
+  auto format = [&](int t, int begin, int end) {
+    std::vector<char>& buffer = buffers[t];
+    std::vector<T> row(n);
+    // Each value takes at most 24 characters plus its delimiter.
+    buffer.resize((size_t)(end - begin) * n * 25 + 1);
+    char* p = &buffer[0];
+    for (int r = begin; r < end; ++r) {
+      rows.fill(r, &row[0]);
+      for (int j = 0; j < n; ++j) {
+	if (j != 0) *p++ = '\t';
+	p += formatshortest(row[j], p);
+      }
+      *p++ = '\n';
+    }
+    buffer.resize(p - &buffer[0]);
+  };
+
+  const int numRows = rows.numRows();
+  for (int batch = 0; batch < numRows; batch += numThreads * rowsPerThread) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+      const int begin = std::min(batch + t * rowsPerThread, numRows);
+      const int end = std::min(begin + rowsPerThread, numRows);
+      if (t == 0) {
+	continue;
+      }
+      threads.push_back(std::thread(format, t, begin, end));
+    }
+    format(0, batch, std::min(batch + rowsPerThread, numRows));
+    for (auto &th : threads) {
+      th.join();
+    }
+    for (int t = 0; t < numThreads; ++t) {
+      if (!buffers[t].empty() &&
+	  fwrite(&buffers[t][0], 1, buffers[t].size(), f) != buffers[t].size()) {
+	return false;
+      }
+    }
+  }
+  return true;
 }
 
-#define LINE_SIZE 2048
+// Write the kernel in the given output, as text or as a bundle that promising
+// can map directly.
+template <typename T>
+bool writeoutput(const KernelRows<T>& rows, const GeneDictionary& genes, const std::vector<int>& order,
+		 const std::string& filename, bool bundle, int numThreads) {
+  std::vector<std::string> names;
+  names.reserve(order.size());
+  for (auto const i : order) {
+    names.push_back(genes.name(i));
+  }
 
-bool readnetwork(FILE* fp, NetMap& network, IndexMap& indices) {
-  char line[LINE_SIZE];
-  int i = 0;
-  
-  while (fgets(line, LINE_SIZE, fp) != 0) {
-    char* a = strtok(line, "\t");
-    char* b = strtok(0, "\t");
-    char* c = strtok(0, "\t");
-    float score = atof(c);
-    //printf("%s, %s, %f\n", a, b, score);
-    network[std::pair<std::string, std::string>(a, b)] = score;
-    if (indices.find(a) == indices.end()) {
-      indices[a] = i++;
+  if (bundle) {
+    NetworkBundleWriter writer;
+    if (!writer.begin(filename, names)) {
+      printf("Bad output file name: %s\n", filename.c_str());
+      return false;
     }
-    if (indices.find(b) == indices.end()) {
-      indices[b] = i++;
+    const int n = rows.numColumns();
+    std::vector<T> row(n);
+    std::vector<float> frow(n);
+    for (int r = 0; r < rows.numRows(); ++r) {
+      rows.fill(r, &row[0]);
+      std::copy(row.begin(), row.end(), frow.begin());
+      if (!writer.writeRow(&frow[0])) {
+	printf("Problem writing bundle %s\n", filename.c_str());
+	return false;
+      }
     }
+    return writer.finish();
   }
+
+  FILE* f = fopen(filename.c_str(), "w");
+  if (f == 0) {
+    printf("Bad output file name: %s\n", filename.c_str());
+    return false;
+  }
+  std::stringstream ss;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (i != 0) ss << "\t";
+    ss << names[i];
+  }
+  fprintf(f, "%s\n", ss.str().c_str());
+  const bool written = writetextrows(rows, f, numThreads);
+  if (fclose(f) != 0 || !written) {
+    printf("Problem writing matrix to %s\n", filename.c_str());
+    return false;
+  }
+  return true;
 }
 
-bool populatematrix(const NetMap& net, const IndexMap& indices, float* const mat, int n) {
-  for (auto const &v : net) {
-    IndexMap::const_iterator it;
-    it = indices.find(v.first.first);
-    if (it == indices.end()) {
-      printf("Index out of range\n");
+// Write one kernel per alpha, to the matching file. A single kernel is
+// inverted directly. A sweep eigendecomposes each component's Laplacian
+// once and rebuilds the kernel for every alpha from the shared eigenbasis,
+// which costs a matrix product per alpha instead of a factorization. If
+// genes is not empty, only those genes' kernel rows are computed and written.
+template <typename T>
+bool writekernels(const NetworkAdjacency& adj, const GeneDictionary& names, const std::vector<int>& genes,
+		  bool invert, const std::vector<T>& alphas, int numThreads,
+		  const std::vector<std::string>& filenames, bool bundle,
+		  size_t memory, const std::string& scratch) {
+  const int n = adj.numNodes();
+  std::vector<int> component, local;
+  std::vector< KernelBlock<T> > blocks;
+  connectedcomponents(adj, component, local, blocks);
+  size_t largest = 0;
+  for (auto const &b : blocks) {
+    largest = std::max(largest, b.nodes.size());
+  }
+  printf("%lu connected components; the largest has %lu genes.\n", blocks.size(), largest);
+
+  // Requested genes come first in the output's columns, then the rest in
+  // their usual order. slot[g] is g's column within its block.
+  const bool subset = !genes.empty();
+  std::vector<int> order(genes);
+  std::vector<int> slot(n, -1);
+  for (auto const g : genes) {
+    KernelBlock<T>& block = blocks[component[g]];
+    slot[g] = block.requested.size();
+    block.requested.push_back(local[g]);
+  }
+  for (int i = 0; i < n; ++i) {
+    if (slot[i] < 0) {
+      order.push_back(i);
+    }
+  }
+  const KernelRows<T> rows(blocks, component, local, order, subset ? genes : order, slot, subset);
+
+  if (!invert || alphas.size() == 1) {
+    if (!computeblocks(adj, local, blocks, invert, subset, alphas[0], numThreads, memory, scratch)) {
+      return false;
+    }
+    return writeoutput(rows, names, order, filenames[0], bundle, numThreads);
+  }
+
+  if (memory > 0 && largest * largest * sizeof(T) > memory) {
+    printf("An alpha sweep keeps each component in memory; it cannot be combined with --memory.\n");
+    return false;
+  }
+  printf("Eigendecomposing the Laplacian.\n");
+  if (!foreachblock(blocks, numThreads, [&](KernelBlock<T>& block) {
+	return (subset && block.requested.empty()) || eigendecomposeblock(adj, local, block);
+      })) {
+    printf("The eigendecomposition did not converge.\n");
+    return false;
+  }
+  for (size_t k = 0; k < alphas.size(); ++k) {
+    const T alpha = alphas[k];
+    printf("alpha = %g\n", (double)alpha);
+    if (!foreachblock(blocks, numThreads, [&](KernelBlock<T>& block) {
+	  if (subset) {
+	    return block.requested.empty() || reconstructcolumns(alpha, block);
+	  }
+	  return reconstructblock(alpha, block);
+	})) {
+      printf("The regularized Laplacian is singular.\n");
+      return false;
+    }
+    if (!writeoutput(rows, names, order, filenames[k], bundle, numThreads)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Write a rank-r factor W of the kernel, K ~ W W^T, as a bundle. Each
+// component's Laplacian is eigendecomposed; the kernel's eigenpairs are
+// those vectors with values 1 / (1 + alpha * lambda), and the r largest
+// across all components become W's columns, scaled by their square roots.
+// The part left out is positive semi-definite, so its largest diagonal
+// entry bounds every entry's error, and that is reported with the others.
+template <typename T>
+bool writefactor(const NetworkAdjacency& adj, const GeneDictionary& names, T alpha, int rank,
+		 int numThreads, const std::string& filename) {
+  const int n = adj.numNodes();
+  std::vector<int> component, local;
+  std::vector< KernelBlock<T> > blocks;
+  connectedcomponents(adj, component, local, blocks);
+  printf("Eigendecomposing the Laplacian of %lu connected components.\n", blocks.size());
+  if (!foreachblock(blocks, numThreads, [&](KernelBlock<T>& block) {
+	return eigendecomposeblock(adj, local, block);
+      })) {
+    printf("The eigendecomposition did not converge.\n");
+    return false;
+  }
+
+  // Every eigenpair as (kernel value, block, column), largest values first.
+  std::vector< std::vector<T> > scales(blocks.size());
+  std::vector< std::pair<int, int> > pairs;
+  for (size_t c = 0; c < blocks.size(); ++c) {
+    bool positive;
+    if (!kernelscales(alpha, blocks[c], scales[c], positive) || !positive) {
+      printf("The kernel is not positive definite; it has no factor.\n");
+      return false;
+    }
+    for (size_t k = 0; k < scales[c].size(); ++k) {
+      pairs.push_back(std::make_pair((int)c, (int)k));
+    }
+  }
+  std::stable_sort(pairs.begin(), pairs.end(), [&](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+      return scales[a.first][a.second] > scales[b.first][b.second];
+    });
+  rank = std::min(rank, n);
+
+  double trace = 0.0, kept = 0.0, frobenius = 0.0, dropped = 0.0;
+  std::vector<double> diagonal(n, 0.0);
+  for (size_t p = 0; p < pairs.size(); ++p) {
+    const KernelBlock<T>& block = blocks[pairs[p].first];
+    const double s = scales[pairs[p].first][pairs[p].second];
+    trace += s;
+    frobenius += s * s;
+    if ((int)p < rank) {
+      kept += s;
+      continue;
+    }
+    dropped += s * s;
+    const size_t m = block.nodes.size();
+    const T* v = &block.vectors[(size_t)pairs[p].second * m];
+    for (size_t i = 0; i < m; ++i) {
+      diagonal[block.nodes[i]] += s * v[i] * v[i];
+    }
+  }
+  printf("Rank %d keeps %.4g%% of the kernel's trace.\n", rank, 100.0 * kept / trace);
+  printf("Spectral error %.4g, relative Frobenius error %.4g, largest entry error %.4g.\n",
+	 (rank < (int)pairs.size()) ? (double)scales[pairs[rank].first][pairs[rank].second] : 0.0,
+	 std::sqrt(dropped / frobenius), *std::max_element(diagonal.begin(), diagonal.end()));
+
+  std::vector<std::string> order;
+  order.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    order.push_back(names.name(i));
+  }
+  NetworkBundleWriter writer;
+  if (!writer.begin(filename, order, kFactorLayout, rank)) {
+    printf("Bad output file name: %s\n", filename.c_str());
+    return false;
+  }
+  std::vector<float> row(rank);
+  for (int g = 0; g < n; ++g) {
+    const KernelBlock<T>& block = blocks[component[g]];
+    const size_t m = block.nodes.size();
+    for (int c = 0; c < rank; ++c) {
+      const int b = pairs[c].first, k = pairs[c].second;
+      row[c] = (b == component[g]) ? std::sqrt(scales[b][k]) * block.vectors[(size_t)k * m + local[g]] : 0.0f;
+    }
+    if (!writer.writeRow(&row[0])) {
+      printf("Problem writing bundle %s\n", filename.c_str());
+      return false;
+    }
+  }
+  return writer.finish();
+}
+
+// Read the genes whose kernel rows are wanted, in order, skipping repeats.
+// Either a GMT file (genes from the third column on) or one gene per line.
+bool readgenes(const std::string& filename, const GeneDictionary& names, std::vector<int>& genes) {
+  std::ifstream in(filename.c_str());
+  if (!in.is_open()) {
+    printf("Problem reading genes from file %s\n", filename.c_str());
+    return false;
+  }
+  std::vector<bool> seen(names.size(), false);
+  int missing = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    std::vector<std::string> fields;
+    std::stringstream ss(line);
+    std::string field;
+    while (std::getline(ss, field, '\t')) {
+      fields.push_back(field);
+    }
+    const size_t first = (fields.size() > 1) ? 2 : 0;
+    for (size_t i = first; i < fields.size(); ++i) {
+      if (fields[i].empty()) {
+	continue;
+      }
+      const int id = names.find(fields[i]);
+      if (id < 0) {
+	missing++;
+      } else if (!seen[id]) {
+	seen[id] = true;
+	genes.push_back(id);
+      }
+    }
+  }
+  if (missing > 0) {
+    printf("%i requested genes are not in the network.\n", missing);
+  }
+  if (genes.empty()) {
+    printf("None of the requested genes are in the network.\n");
+    return false;
+  }
+  return true;
+}
+
+// Name the kernel for one alpha of a sweep by inserting the alpha before the
+// output file's extension: k.tsv becomes k_alpha0.01.tsv.
+std::string sweepfilename(const std::string& filename, float alpha) {
+  std::stringstream ss;
+  ss << "_alpha" << alpha;
+  size_t dot = filename.rfind('.');
+  size_t slash = filename.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = filename.size();
+  }
+  return filename.substr(0, dot) + ss.str() + filename.substr(dot);
+}
+
+// Read a full kernel written by reglaplacian, as text or as a bundle, into
+// kernel (row-major, numNodes x numNodes); names are interned in column
+// order. A --genes slab lacks most rows and is refused.
+bool readkernel(const std::string& filename, GeneDictionary& names, std::vector<float>& kernel) {
+  int numNodes(0);
+  if (isNetworkBundle(filename)) {
+    NetworkBundle bundle;
+    if (!bundle.open(filename)) {
+      printf("Problem reading kernel from file %s\n", filename.c_str());
+      return false;
+    }
+    if (bundle.layout() != kDenseLayout && bundle.layout() != kPackedLayout) {
+      printf("%s is a factor or quantized bundle; an update needs the full kernel.\n", filename.c_str());
+      return false;
+    }
+    names = bundle.genes();
+    numNodes = bundle.numNodes();
+    kernel.resize((size_t)numNodes * numNodes);
+    if (bundle.layout() == kPackedLayout) {
+      const PackedSimilarities packed(bundle.matrix(), numNodes);
+      for (int i = 0; i < numNodes; ++i) {
+	for (int j = 0; j < numNodes; ++j) {
+	  kernel[(size_t)i * numNodes + j] = packed(i, j);
+	}
+      }
     } else {
-      const int i1 = it->second;
-      it = indices.find(v.first.second);
-      if (it == indices.end()) {
-	printf("Index out of range\n");
+      std::copy(bundle.matrix(), bundle.matrix() + kernel.size(), kernel.begin());
+    }
+    return true;
+  }
+
+  MatrixInputStream in(filename);
+  std::string line;
+  if (!in.good() || !std::getline(in, line)) {
+    printf("Problem reading kernel from file %s\n", filename.c_str());
+    return false;
+  }
+  numNodes = parseNamesLine(line, names);
+  kernel.assign((size_t)numNodes * numNodes, 0.0f);
+
+  // Parse on all cores straight from a mapping when the file is not
+  // compressed, counting its rows separately.
+  int numRows(0);
+  MappedFile mapped;
+  const std::streamoff offset = in.tellg();
+  if (!in.compressed() && offset >= 0 && mapped.open(filename) &&
+      readEntireNetwork(mapped, offset, numNodes, &kernel[0])) {
+    const char* p = mapped.data() + offset;
+    const char* const end = mapped.data() + mapped.size();
+    while (p < end) {
+      const char* nl = (const char*)memchr(p, '\n', end - p);
+      numRows++;
+      p = (nl == 0) ? end : nl + 1;
+    }
+  } else {
+    while (numRows < numNodes && std::getline(in, line)) {
+      parseMatrixRow(line, numNodes, &kernel[(size_t)numRows * numNodes]);
+      numRows++;
+    }
+  }
+  if (numRows < numNodes) {
+    printf("%s has %i rows for %i genes; --update needs a full kernel, not one written with --genes.\n",
+	   filename.c_str(), numRows, numNodes);
+    return false;
+  }
+  return true;
+}
+
+// Sum the weight changes listed for the same pair and drop pairs whose
+// changes cancel out. Self-loops are kept: their weight counts towards the
+// gene's degree, so they change the diagonal of the Laplacian.
+void mergedeltas(std::vector<TEdge>& deltas) {
+  for (auto &e : deltas) {
+    if (e.from > e.to) {
+      std::swap(e.from, e.to);
+    }
+  }
+  std::stable_sort(deltas.begin(), deltas.end(), [](const TEdge& a, const TEdge& b) {
+      return a.from < b.from || (a.from == b.from && a.to < b.to);
+    });
+  size_t kept = 0;
+  for (size_t k = 0; k < deltas.size(); ) {
+    TEdge e = deltas[k];
+    for (k++; k < deltas.size() && deltas[k].from == e.from && deltas[k].to == e.to; ++k) {
+      e.weight += deltas[k].weight;
+    }
+    if (e.weight != 0.0f) {
+      deltas[kept++] = e;
+    }
+  }
+  deltas.resize(kept);
+}
+
+static void takekernel(std::vector<float>& from, std::vector<float>& to) { to.swap(from); }
+static void takekernel(std::vector<float>& from, std::vector<double>& to) {
+  to.assign(from.begin(), from.end());
+  std::vector<float>().swap(from);
+}
+
+// Update a kernel K = (I + alpha * L)^-1 for changes in edge weights with the
+// Sherman-Morrison-Woodbury formula. Changing the weight of edge (i, j) by d
+// adds alpha * d * u u^T to I + alpha * L, with u = e_i - e_j, or u = e_i
+// for a self-loop, so for r changes at once, U = [u_1 .. u_r] and
+// C = diag(alpha * d),
+//   K' = K - (K U) (C^-1 + U^T K U)^-1 (K U)^T,
+// where K U is just kernel columns or differences of them. That costs O(n^2 r)
+// instead of the O(n^3) of inverting again. The changes are applied in
+// batches to bound the memory for K U. Returns false if an update leaves
+// I + alpha * L singular.
+template <typename T>
+bool woodburyupdate(std::vector<T>& kernel, int n, const std::vector<TEdge>& deltas, T alpha) {
+  const int batch = 256;
+  for (size_t first = 0; first < deltas.size(); first += batch) {
+    int r = std::min(deltas.size() - first, (size_t)batch);
+    // K is symmetric, so its row-major storage is also column-major.
+    std::vector<T> ku((size_t)n * r);
+    for (int k = 0; k < r; ++k) {
+      const TEdge& e = deltas[first + k];
+      const T* ci = &kernel[(size_t)e.from * n];
+      const T* cj = &kernel[(size_t)e.to * n];
+      T* col = &ku[(size_t)k * n];
+      if (e.from == e.to) {
+	std::copy(ci, ci + n, col);
       } else {
-	const int i2 = it->second;
-	mat[i1 * n + i2] = v.second;
-	// Assume undirected: symmetric
-	mat[i2 * n + i1] = v.second;
+	for (int c = 0; c < n; ++c) {
+	  col[c] = ci[c] - cj[c];
+	}
+      }
+    }
+    // The capacitance matrix C^-1 + U^T K U. It is symmetric but indefinite
+    // when weights go down, so it is solved with LU.
+    std::vector<T> s((size_t)r * r);
+    for (int l = 0; l < r; ++l) {
+      const T* col = &ku[(size_t)l * n];
+      for (int k = 0; k < r; ++k) {
+	const TEdge& e = deltas[first + k];
+	s[(size_t)l * r + k] = (e.from == e.to) ? col[e.from] : col[e.from] - col[e.to];
+      }
+    }
+    for (int k = 0; k < r; ++k) {
+      s[(size_t)k * r + k] += 1.0 / (alpha * deltas[first + k].weight);
+    }
+    std::vector<T> z((size_t)r * n);
+    for (int c = 0; c < n; ++c) {
+      for (int k = 0; k < r; ++k) {
+	z[(size_t)c * r + k] = ku[(size_t)k * n + c];
       }
     }
+    std::vector<int> ipiv(r);
+    int info;
+    getrf(&r, &s[0], &ipiv[0], &info);
+    if (info != 0) {
+      return false;
+    }
+    getrs(&r, &n, &s[0], &ipiv[0], &z[0], &info);
+    if (info != 0) {
+      return false;
+    }
+    T minusone = -1.0, one = 1.0;
+    char notrans = 'N';
+    gemm(&notrans, &notrans, &n, &n, &r, &minusone, &ku[0], &z[0], &one, &kernel[0]);
   }
+  return true;
 }
 
-void writematrixtofile(const float* mat, int n, FILE* f) {
-  
-  for (int i = 0; i < n; ++i, mat += n) {
-    std::stringstream sstream;
-    
-    for (int j = 0; j < n; ++j) {
-      //if (j != 0) v = v + "\t";
-      //v = v + std::to_string(mat[j]);
-      if (j != 0) sstream << "\t";
-      sstream << mat[j];
+// Apply edge weight changes to an existing kernel and write the result.
+// Genes that the kernel lacks are added as isolated nodes, whose kernel is
+// the identity, before their edges are applied.
+template <typename T>
+bool updatekernel(std::vector<float>& previous, int numPrevious, const GeneDictionary& names,
+		  std::vector<TEdge>& deltas, T alpha, int numThreads,
+		  const std::string& filename, bool bundle) {
+  const int n = names.size();
+  mergedeltas(deltas);
+  printf("Updating the kernel for %lu changed edges and %i new genes.\n", deltas.size(), n - numPrevious);
+
+  std::vector< KernelBlock<T> > blocks(1);
+  KernelBlock<T>& block = blocks[0];
+  takekernel(previous, block.mat);
+  if (n > numPrevious) {
+    block.mat.resize((size_t)n * n);
+    for (int i = numPrevious - 1; i >= 0; --i) {
+      T* row = &block.mat[(size_t)i * n];
+      std::copy_backward(&block.mat[(size_t)i * numPrevious], &block.mat[(size_t)(i + 1) * numPrevious],
+			 row + numPrevious);
+      std::fill(row + numPrevious, row + n, (T)0.0);
+    }
+    std::fill(&block.mat[(size_t)numPrevious * n], &block.mat[0] + block.mat.size(), (T)0.0);
+    for (int i = numPrevious; i < n; ++i) {
+      block.mat[(size_t)i * n + i] = 1.0;
     }
-    fprintf(f, "%s\n", sstream.str().c_str());
   }
+  if (!woodburyupdate(block.mat, n, deltas, alpha)) {
+    printf("The updated regularized Laplacian is singular.\n");
+    return false;
+  }
+
+  // The whole kernel is written as a single block, in its own order.
+  std::vector<int> order(n), component(n, 0), slot;
+  for (int i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  block.nodes = order;
+  const KernelRows<T> rows(blocks, component, order, order, order, slot, false);
+  return writeoutput(rows, names, order, filename, bundle, numThreads);
 }
 
 int main(int argc, char** argv)
 {
   
   TCLAP::CmdLine cmd("Calc graph kernel of network.", ' ', "0.9");
-  TCLAP::ValueArg<std::string> netFilename("n", "network", "Network file", true, "", "string");
+  TCLAP::ValueArg<std::string> netFilename("n", "network", "Network file (with --update, the changes in edge weights)", true, "", "string");
   cmd.add(netFilename);
   TCLAP::ValueArg<std::string> outFilename("o", "outfile", "Output matrix file", true, "", "string");
   cmd.add(outFilename);
   TCLAP::ValueArg<float> alpha("a", "alpha", "Alpha parameter", false, 0.01f, "float");
   cmd.add(alpha);
+  TCLAP::ValueArg<std::string> alphaList("", "alphas", "Comma-separated alphas to sweep; writes one kernel per alpha", false, "", "string");
+  cmd.add(alphaList);
   TCLAP::ValueArg<std::string> method("k", "kernel", "Graph kernel", false, "rl", "string");
   cmd.add(method);
+  TCLAP::SwitchArg doublePrecision("d", "double", "Invert in double precision (uses twice the memory)", false);
+  cmd.add(doublePrecision);
+  TCLAP::ValueArg<std::string> genesFilename("g", "genes", "Only write the kernel rows of these genes (GMT file, or one gene per line)", false, "", "string");
+  cmd.add(genesFilename);
+  TCLAP::SwitchArg bundle("b", "bundle", "Write a binary bundle instead of a text matrix", false);
+  cmd.add(bundle);
+  TCLAP::ValueArg<int> numThreads("t", "threads", "Number of threads (default: all cores)", false, 0, "int");
+  cmd.add(numThreads);
+  TCLAP::ValueArg<int> memory("M", "memory", "Memory budget in MB; larger components are inverted out of core (default: no limit)", false, 0, "int");
+  cmd.add(memory);
+  TCLAP::ValueArg<std::string> scratchDir("", "scratch", "Directory for out of core scratch files (default: the output's)", false, "", "string");
+  cmd.add(scratchDir);
+  TCLAP::ValueArg<std::string> updateFilename("u", "update", "Update this kernel, built with the same alpha, for the edge weight changes in the network file", false, "", "string");
+  cmd.add(updateFilename);
+  TCLAP::ValueArg<int> rank("r", "rank", "Write a factor bundle of this rank instead of the full kernel", false, 0, "int");
+  cmd.add(rank);
   
   cmd.parse(argc, argv);
+
+  std::vector<float> alphas;
+  std::vector<std::string> ofilenames;
+  if (alphaList.isSet()) {
+    std::stringstream ss(alphaList.getValue());
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      char* end;
+      const float a = strtof(item.c_str(), &end);
+      if (item.empty() || *end != '\0') {
+	printf("Bad alpha in --alphas: '%s'\n", item.c_str());
+	return(-1);
+      }
+      alphas.push_back(a);
+      ofilenames.push_back(sweepfilename(outFilename.getValue(), a));
+    }
+    if (alphas.empty()) {
+      printf("--alphas needs at least one value.\n");
+      return(-1);
+    }
+  } else {
+    alphas.push_back(alpha.getValue());
+    ofilenames.push_back(outFilename.getValue());
+  }
   
   std::string nfilename = netFilename.getValue();
   
-  FILE* f = fopen(nfilename.c_str(), "r");
-  if (f == 0) {
+  // An update starts from the existing kernel's genes; genes only seen in
+  // the changes come after them.
+  const bool update = updateFilename.isSet();
+  if (update && (alphaList.isSet() || genesFilename.isSet() || method.getValue() == "amat" || memory.getValue() > 0 ||
+		 rank.isSet())) {
+    printf("--update writes one full rl kernel in memory; it cannot be combined with --alphas, --genes, -k amat, --memory or --rank.\n");
+    return(-1);
+  }
+  if (update && alphas[0] == 0.0f) {
+    printf("--update needs a non-zero alpha.\n");
+    return(-1);
+  }
+  GeneDictionary names;
+  std::vector<float> previous;
+  if (update && !readkernel(updateFilename.getValue(), names, previous)) {
+    return(-1);
+  }
+  const int numPrevious = names.size();
+
+  MatrixInputStream in(nfilename);
+  if (!in.good()) {
     printf("Problem reading network from file %s\n", nfilename.c_str());
     return(-1);
   }
-  NetMap net;
-  IndexMap indices;
-  readnetwork(f, net, indices);
-  fclose(f);
-  
-  IndexMap::const_iterator it = indices.begin();
-  // for (; it != indices.end(); it++) {
-  //   printf("%s, %i\n", it->first.c_str(), it->second);
-  // }
-
-  const int n = indices.size();
-  float* mat = (float*)malloc(sizeof(float) * n * n);
-  if (mat == 0) {
-    printf("Problem allocating adjacency matrix of %i bytes.", sizeof(float) * n * n);
+  std::vector<TEdge> edges;
+  if (!readEdgeList(in, names, edges)) {
+    printf("Problem reading network from file %s\n", nfilename.c_str());
     return(-1);
   }
-  // Initialize to zeros.
-  for (int i = 0; i < n * n; ++i) {
-    mat[i] = 0.0f;
+  if (update) {
+    bool ok;
+    if (doublePrecision.getValue()) {
+      ok = updatekernel(previous, numPrevious, names, edges, (double)alphas[0], numThreads.getValue(),
+			ofilenames[0], bundle.getValue());
+    } else {
+      ok = updatekernel(previous, numPrevious, names, edges, alphas[0], numThreads.getValue(),
+			ofilenames[0], bundle.getValue());
+    }
+    return ok ? 0 : -1;
   }
-  populatematrix(net, indices, mat, n);
+  uniqueEdges(edges, numThreads.getValue());
+  NetworkAdjacency adj;
+  adj.assign(names.size(), edges);
+  std::vector<TEdge>().swap(edges);
 
+  std::vector<int> genes;
+  if (genesFilename.isSet() && !readgenes(genesFilename.getValue(), names, genes)) {
+    return(-1);
+  }
+  if (bundle.getValue() && !genes.empty()) {
+    printf("A bundle holds the full kernel; --bundle cannot be combined with --genes.\n");
+    return(-1);
+  }
 
   const std::string m = method.getValue();
-
-  if (m == "amat") {
-    printf("Adjacency matrix\n");
-  } else {
+  const bool invert = (m != "amat");
+  if (invert) {
     printf("Regularized Laplacian\n");
-    float a = alpha.getValue();
-    regularizedlaplacian(a, mat, n);
+  } else {
+    printf("Adjacency matrix\n");
+    alphas.resize(1);
+    ofilenames.resize(1);
   }
-  std::string ofilename = outFilename.getValue();
-  f = fopen(ofilename.c_str(), "w");
-  if (f == 0) {
-    printf("Bad output file name: %s\n", ofilename.c_str());
-    return(-1);
+
+  if (rank.isSet()) {
+    if (rank.getValue() <= 0 || !invert || alphaList.isSet() || !genes.empty() || memory.getValue() > 0) {
+      printf("--rank needs a positive rank and one rl kernel; it cannot be combined with --alphas, --genes or --memory.\n");
+      return(-1);
+    }
+    bool ok;
+    if (doublePrecision.getValue()) {
+      ok = writefactor(adj, names, (double)alphas[0], rank.getValue(), numThreads.getValue(), ofilenames[0]);
+    } else {
+      ok = writefactor(adj, names, alphas[0], rank.getValue(), numThreads.getValue(), ofilenames[0]);
+    }
+    return ok ? 0 : -1;
   }
-  
-  std::map<int, std::string> names;
-  for (auto const &v : indices) {
-    names[v.second] = v.first;
+
+  const size_t budget = (size_t)std::max(0, memory.getValue()) << 20;
+  std::string scratch = scratchDir.getValue();
+  if (scratch.empty()) {
+    const size_t slash = ofilenames[0].rfind('/');
+    scratch = (slash == std::string::npos) ? "." : ofilenames[0].substr(0, slash + 1);
   }
-  std::stringstream ss;
-  for (int i = 0; i < n; ++i) {
-    if (i != 0) ss << "\t";
-    ss << names[i];
+
+  bool ok;
+  if (doublePrecision.getValue()) {
+    std::vector<double> dalphas(alphas.begin(), alphas.end());
+    ok = writekernels(adj, names, genes, invert, dalphas, numThreads.getValue(), ofilenames, bundle.getValue(),
+		      budget, scratch);
+  } else {
+    ok = writekernels(adj, names, genes, invert, alphas, numThreads.getValue(), ofilenames, bundle.getValue(),
+		      budget, scratch);
   }
-  fprintf(f, "%s\n", ss.str().c_str());
-  writematrixtofile(mat, n, f);
-  fclose(f);
-  // for (int i = 0; i < n; ++i) {
-  //   for (int j = 0; j < n; ++j) {
-  //     printf("%f ", mat[i*n + j]);
-  //   }
-  //   printf("\n");
-  // }
-  
-  free(mat);
-  return 0;
+  return ok ? 0 : -1;
 }
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <string>
+#include <tclap/CmdLine.h>
+
+#include "MatrixIndex.h"
+
+int main(int argc, char** argv)
+{
+  TCLAP::CmdLine cmd("Write a row offset index next to a text similarity matrix.", ' ', "0.9");
+  TCLAP::ValueArg<std::string> matrixFilename("m", "matrix", "Text similarity matrix", true, "", "string");
+  cmd.add(matrixFilename);
+
+  cmd.parse(argc, argv);
+
+  const std::string mfilename = matrixFilename.getValue();
+  if (!writeMatrixIndex(mfilename)) {
+    return(-1);
+  }
+
+  const std::string ofilename = matrixIndexFilename(mfilename);
+  MatrixIndex index;
+  if (!index.open(ofilename)) {
+    return(-1);
+  }
+  printf("Indexed %d rows of %s in %s\n", (int)index.numRows(), mfilename.c_str(), ofilename.c_str());
+  return 0;
+}
@@ -1,9 +1,17 @@
 #include "coreroutines.h"
 #include "CompleteGraphScorer.h"
+#include "ScoreKernels.h"
 #include "FastScorer.h"
 #include "PValueModuleScorer.h"
+#include "NetworkBundle.h"
+#include "MatrixParser.h"
+#include "CompressedStream.h"
+#include "SparseSimilarities.h"
+#include "EdgeList.h"
+#include "OnDemandKernel.h"
 #include <tclap/CmdLine.h>
 #include <cstring>
+#include <memory>
 
 typedef std::map<std::string, TGroups> TDiseases;
 
@@ -69,7 +77,7 @@ bool parseMultipleDiseaseFile(const std::string& filename, TDiseases& diseaseEnt
 //   return true;
 // }
 
-bool readDegreeGroups(const std::string& filename, TIndexMap& geneToIndexMap, std::map<int, int>& nodeDegreeGroup) {
+bool readDegreeGroups(const std::string& filename, const GeneDictionary& geneToIndexMap, std::map<int, int>& nodeDegreeGroup) {
   std::ifstream dinfile(filename);
   TGroups groups;
   
@@ -80,7 +88,10 @@ bool readDegreeGroups(const std::string& filename, TIndexMap& geneToIndexMap, st
   int i = 0;
   for (auto const& g : groups) {
     for (auto const& node : g.second) {
-      nodeDegreeGroup[geneToIndexMap[node]] = i;
+      const int id = geneToIndexMap.find(node);
+      if (id >= 0) {
+	nodeDegreeGroup[id] = i;
+      }
     }
     i++;
   }
@@ -89,13 +100,128 @@ bool readDegreeGroups(const std::string& filename, TIndexMap& geneToIndexMap, st
   return true;
 }
 
+// Load the whole similarity matrix, for scoring against every node in the
+// network. Text matrices are copied into mat (owned by the caller), either
+// dense or as a packed upper triangle; bundles are used in place. ninfile
+// must be positioned just past the names line. Mapped text is parsed on
+// numThreads threads (0: every core).
+SimilarityMatrix* readFullSimilarities(const std::string& nfilename, std::istream& ninfile,
+				       const NetworkBundle& bundle, const bool bundled,
+				       const int numNodes, const bool packed, float*& mat,
+				       const int numThreads) {
+  if (bundled) {
+    std::cout << "Mapped network bundle of " << bundle.matrixBytes() / (1024*1024*1024.0) << "GB." << std::endl;
+    if (bundle.layout() == kFactorLayout) {
+      std::cout << "Similarities are a factor of rank " << bundle.rank() << "." << std::endl;
+    } else if (bundle.layout() == kHalfLayout || bundle.layout() == kInt8Layout) {
+      std::cout << "Similarities are stored in " << (bundle.layout() == kHalfLayout ? "half precision" : "int8")
+		<< "." << std::endl;
+    }
+    return bundle.similarities();
+  }
+
+  std::cout << "Reading entire network into memory. This may take a while." << std::endl;
+  // Allocate a big block of memory. This could easily fail.
+  const size_t numValues = packed ? PackedSimilarities::packedSize(numNodes) : (size_t)numNodes * numNodes;
+  mat = (float*)malloc(sizeof(float) * numValues);
+  if (mat == 0) {
+    std::cerr << "Could not allocate matrix buffer of ";
+    std::cerr << sizeof(float) * numValues << " bytes." << std::endl;
+    exit(-1);
+  }
+
+  // Parse the mapped file on numThreads threads. Fall back to the stream
+  // for compressed inputs, which cannot be mapped.
+  MappedFile mapped;
+  const std::streamoff offset = ninfile.tellg();
+  const bool parsed = (offset >= 0 && mapped.open(nfilename) &&
+		       (packed ? readEntireNetworkPacked(mapped, offset, numNodes, mat, numThreads)
+			: readEntireNetwork(mapped, offset, numNodes, mat, numThreads)));
+  if (!parsed) {
+    if (packed) {
+      readEntireNetworkPacked(ninfile, numNodes, mat);
+    } else {
+      readEntireNetwork(ninfile, numNodes, mat);
+    }
+  }
+  SimilarityMatrix* similarities(0);
+  if (packed) {
+    similarities = new PackedSimilarities(mat, numNodes);
+  } else {
+    similarities = new DenseSimilarities(mat, numNodes);
+  }
+  std::cout << "Completed reading network of " << sizeof(float) * numValues / (1024*1024*1024.0) << "GB." << std::endl;
+  return similarities;
+}
+
+// Expands every row of a matrix in another layout for the sparse builder.
+class TAddRows {
+ public:
+ TAddRows(SparseSimilaritiesBuilder& builder, const int numNodes) : mBuilder(builder), mNumNodes(numNodes) {}
+  template <typename M>
+  bool operator()(const M& similarities) {
+    std::vector<int> columns(mNumNodes);
+    std::vector<float> row(mNumNodes);
+    for (int j = 0; j < mNumNodes; ++j) {
+      columns[j] = j;
+    }
+    for (int i = 0; i < mNumNodes; ++i) {
+      gatherSimilarities(similarities, i, &columns[0], mNumNodes, &row[0]);
+      mBuilder.addRow(i, &row[0]);
+    }
+    return true;
+  }
+ private:
+  SparseSimilaritiesBuilder& mBuilder;
+  const int mNumNodes;
+};
+
+// Load the whole similarity matrix into sparse storage one row at a time, so
+// memory scales with the pairs kept rather than with numNodes^2. Text matrices
+// are parsed on numThreads threads (0: every core) when they can be mapped.
+SimilarityMatrix* readSparseSimilarities(const std::string& nfilename, std::istream& ninfile,
+					 const NetworkBundle& bundle, const bool bundled, const int numNodes,
+					 const int topK, const float minSimilarity, const float missingValue,
+					 const int numThreads) {
+  std::cout << "Reading network into sparse storage. This may take a while." << std::endl;
+  SparseSimilaritiesBuilder builder(numNodes, topK, minSimilarity);
+  std::vector<float> row(numNodes, 0.0f);
+  if (bundled && bundle.layout() == kDenseLayout) {
+    for (int i = 0; i < numNodes; ++i) {
+      builder.addRow(i, bundle.matrix() + (size_t)numNodes * i);
+    }
+  } else if (bundled) {
+    std::unique_ptr<SimilarityMatrix> full(bundle.similarities());
+    TAddRows addRows(builder, numNodes);
+    dispatchSimilarities(*full, addRows);
+  } else {
+    MappedFile mapped;
+    const std::streamoff offset = ninfile.tellg();
+    if (offset < 0 || !mapped.open(nfilename) ||
+	!readNetworkRows(mapped, offset, numNodes, builder, numThreads)) {
+      std::string line;
+      for (int i = 0; i < numNodes && !ninfile.eof(); ++i) {
+	std::getline(ninfile, line);
+	std::fill(row.begin(), row.end(), 0.0f);
+	parseMatrixRow(line, numNodes, &row[0]);
+	builder.addRow(i, &row[0]);
+      }
+    }
+  }
+  SparseSimilarities* similarities = builder.finish(missingValue);
+  std::cout << "Kept " << similarities->numEntries() << " similarities in "
+	    << similarities->bytes() / (1024*1024*1024.0) << "GB." << std::endl;
+  return similarities;
+}
+
 int main(int argc, char** argv) {
   try {
 
     // Command-line parsing
     TCLAP::CmdLine cmd("Prioritization of candidate genes in disjoint sets.", ' ', "0.9");
-    TCLAP::ValueArg<std::string> netFilename("s", "similarities", "Similarity matrix", true, "", "string");
-    cmd.add(netFilename);
+    TCLAP::ValueArg<std::string> netFilename("s", "similarities", "Similarity matrix (text or binary bundle)", true, "", "string");
+    TCLAP::ValueArg<std::string> edgeFilename("n", "network", "Sparse network (edge list); kernel rows are computed as needed", true, "", "string");
+    cmd.xorAdd(netFilename, edgeFilename);
     TCLAP::ValueArg<std::string> groupsFilename("g", "groups", "Groups file", true, "", "string");
     cmd.add(groupsFilename);
     TCLAP::ValueArg<int> pvalIterations("p", "pval", "Pvalue iterations", false, -1, "int");
@@ -105,7 +231,7 @@ int main(int argc, char** argv) {
     //TCLAP::ValueArg<int> cGroupSize("s", "size", "Complete graph group size", false, 3, "int");
     //cmd.add(cGroupSize);
 
-    TCLAP::ValueArg<std::string> method("m", "method", "Scoring method, SUM, MAX, MAX-CLIQUE, MAX-3SETS, MAX-4SETS", false, "MAX-4SETS", "string");
+    TCLAP::ValueArg<std::string> method("m", "method", "Scoring method, SUM, MAX, MAX-CLIQUE, MAX-3SETS ... MAX-8SETS", false, "MAX-4SETS", "string");
     cmd.add(method);
 
     //TCLAP::ValueArg<std::string> degree("d", "degree_groups", "Degree groups for node permutations", false, "", "string");
@@ -117,6 +243,21 @@ int main(int argc, char** argv) {
 
     TCLAP::SwitchArg clamp("c", "clamp", "Clamp complete graph scorers", false);
     cmd.add(clamp);
+
+    TCLAP::SwitchArg packed("", "packed", "Hold the full matrix as a packed upper triangle (p-value mode)", false);
+    cmd.add(packed);
+    TCLAP::ValueArg<int> topK("", "top-k", "Keep only each gene's k most similar genes (p-value mode)", false, 0, "int");
+    cmd.add(topK);
+    TCLAP::ValueArg<float> minSimilarity("", "min-similarity", "Keep only pairs at least this similar (p-value mode)", false, 0.0f, "float");
+    cmd.add(minSimilarity);
+    TCLAP::ValueArg<float> missingSimilarity("", "missing", "Similarity of pairs dropped by --top-k or --min-similarity", false, 0.0f, "float");
+    cmd.add(missingSimilarity);
+    TCLAP::ValueArg<float> alpha("a", "alpha", "Alpha of the regularized Laplacian kernel, with -n", false, 0.01f, "float");
+    cmd.add(alpha);
+    TCLAP::ValueArg<int> rowCache("", "row-cache", "Memory in MB for kernel rows solved with -n", false, 1024, "int");
+    cmd.add(rowCache);
+    TCLAP::ValueArg<int> numThreads("t", "threads", "Number of threads (default: all cores)", false, 0, "int");
+    cmd.add(numThreads);
     
     // Read in command-line options.
     cmd.parse(argc, argv);
@@ -142,9 +283,29 @@ int main(int argc, char** argv) {
     // Do we calculate a p-value?
     int pIterations = pvalIterations.getValue();
 
+    // Sparse storage keeps only the strongest pairs of the full matrix.
+    const bool sparse = topK.isSet() || minSimilarity.isSet();
+    const float minKept = minSimilarity.isSet() ? minSimilarity.getValue() : -std::numeric_limits<float>::infinity();
+    if (sparse && packed.getValue()) {
+      printf("--packed cannot be combined with --top-k or --min-similarity.\n");
+      return(-1);
+    }
+    // Without p-values only the groups' genes are read, always densely.
+    if (pIterations == -1 && (sparse || packed.getValue() || missingSimilarity.isSet())) {
+      printf("--packed, --top-k, --min-similarity and --missing only apply with -p.\n");
+      return(-1);
+    }
+
+    // A sparse network only gives the kernel rows of the genes in the groups.
+    const bool onDemand = edgeFilename.isSet();
+    if (onDemand && pIterations != -1) {
+      printf("P-values need the whole kernel; build it with reglaplacian and pass it with -s.\n");
+      return(-1);
+    }
+
     // Get network filename
-    std::string nfilename = netFilename.getValue();
-    std::ifstream ninfile(nfilename);
+    std::string nfilename = onDemand ? edgeFilename.getValue() : netFilename.getValue();
+    MatrixInputStream ninfile(nfilename);
     std::string line;
 
     // // Grab degree groups
@@ -161,22 +322,50 @@ int main(int argc, char** argv) {
     //   }
     // }
     
-    // Grab network names
-    std::getline(ninfile, line);
-    TIndexMap fullMap, map;
-    int numNodes = parseNamesLine(line, fullMap);
+    // Grab network names. Binary bundles carry their own name table.
+    NetworkBundle bundle;
+    const bool bundled = !onDemand && isNetworkBundle(nfilename);
+    GeneDictionary fullMap, map;
+    NetworkAdjacency adjacency;
+    int numNodes(0);
+    if (onDemand) {
+      std::vector<TEdge> edges;
+      if (!ninfile.good() || !readEdgeList(ninfile, fullMap, edges)) {
+	printf("Problem reading network from file %s\n", nfilename.c_str());
+	return(-1);
+      }
+      uniqueEdges(edges);
+      numNodes = fullMap.size();
+      adjacency.assign(numNodes, edges);
+    } else if (bundled) {
+      if (!bundle.open(nfilename)) {
+	return(-1);
+      }
+      numNodes = bundle.numNodes();
+      fullMap = bundle.genes();
+    } else {
+      std::getline(ninfile, line);
+      numNodes = parseNamesLine(line, fullMap);
+    }
 
+    // mat is only allocated when the matrix has to be copied out of a file;
+    // similarities may instead point straight into a mapped bundle.
     float* mat(0);
+    SimilarityMatrix* similarities(0);
     IModuleScorer* moduleScorer(0);
     int matrixWidth(0);
 
     // Make module scorer
     std::string meth = method.getValue();
     std::transform(meth.begin(), meth.end(), meth.begin(), ::tolower);
-    if (meth == "max-3sets") {
-      moduleScorer = new CompleteGraphFasterScorer(3, clamp.getValue());
-    } else if (meth == "max-4sets" ) {
-      moduleScorer = new CompleteGraphFasterScorer(4, clamp.getValue());
+    int setSize(0);
+    for (int k = 3; k <= kMaxSetSize; ++k) {
+      if (meth == "max-" + std::to_string(k) + "sets") {
+	setSize = k;
+      }
+    }
+    if (setSize > 0) {
+      moduleScorer = new CompleteGraphFasterScorer(setSize, clamp.getValue(), numThreads.getValue());
     } else if (meth == "max") {
       moduleScorer = new SimpleScorer();
     } else if (meth == "sum") {
@@ -184,7 +373,7 @@ int main(int argc, char** argv) {
     } else if (meth == "max-clique") {
       moduleScorer = new FastScorer();
     } else {
-      printf("Error with method: %s. Acceptable methods: SUM, MAX, MAX-CLIQUE, MAX-3SETS, MAX-4SETS", meth.c_str());
+      printf("Error with method: %s. Acceptable methods: SUM, MAX, MAX-CLIQUE, MAX-3SETS ... MAX-%dSETS", meth.c_str(), kMaxSetSize);
       return(-1);
     }
       
@@ -206,8 +395,8 @@ int main(int argc, char** argv) {
       //std::string dFileName = degree.getValue();
       std::string dFileName = "";
       if (dFileName == "") {
-	for (auto const& i : fullMap) {
-	  nodeDegreeGroups[i.second] = 0;
+	for (int i = 0; i < fullMap.size(); ++i) {
+	  nodeDegreeGroups[i] = 0;
 	}
       } else {
 	if (false == readDegreeGroups(dFileName, fullMap, nodeDegreeGroups)) {
@@ -231,7 +420,25 @@ int main(int argc, char** argv) {
 
 	std::cout << "Pulling out necessary subnetwork from file." << std::endl;
 	// Pull in values from full matrix
-	readEntriesFromNetwork(ninfile, fullMap, entries, map, mat, matrixWidth);
+	if (onDemand) {
+	  OnDemandKernel kernel(adjacency, alpha.getValue(), (size_t)std::max(0, rowCache.getValue()) << 20);
+	  readEntriesFromKernel(kernel, fullMap, entries, map, mat, matrixWidth, numThreads.getValue());
+	} else if (bundled) {
+	  readEntriesFromBundle(bundle, fullMap, entries, map, mat, matrixWidth);
+	} else {
+	  // Scan the mapped file for the wanted rows, or seek to them when
+	  // there is a row index next to it. Compressed inputs are streamed.
+	  MappedFile mapped;
+	  MatrixIndex index;
+	  const std::streamoff offset = ninfile.tellg();
+	  const bool indexed = openMatrixIndex(nfilename, index);
+	  if (offset < 0 || !mapped.open(nfilename) ||
+	      !readEntriesFromNetwork(mapped, offset, fullMap, entries, map, mat, matrixWidth,
+				      indexed ? &index : 0)) {
+	    readEntriesFromNetwork(ninfile, fullMap, entries, map, mat, matrixWidth);
+	  }
+	}
+	similarities = new DenseSimilarities(mat, matrixWidth);
       }
       else {
 	// We need to calculate empirical p-values.
@@ -244,24 +451,17 @@ int main(int argc, char** argv) {
       
 	matrixWidth = numNodes;
 	map = fullMap;
-	std::cout << "Reading entire network into memory. This may take a while." << std::endl;
-
-	// Allocate a big block of memory. This could easily fail.
-	mat = (float*)malloc(sizeof(float) * matrixWidth * matrixWidth);
-	if (mat == 0) {
-	  std::cerr << "Could not allocate matrix buffer of ";
-	  std::cerr << (int)(matrixWidth * matrixWidth * sizeof(float)) << " bytes." << std::endl;
-	  exit(-1);
+	if (sparse) {
+	  similarities = readSparseSimilarities(nfilename, ninfile, bundle, bundled, numNodes,
+						topK.getValue(), minKept, missingSimilarity.getValue(), numThreads.getValue());
+	} else {
+	  similarities = readFullSimilarities(nfilename, ninfile, bundle, bundled, numNodes, packed.getValue(), mat,
+					      numThreads.getValue());
 	}
-
-	// Read the network from the stream
-	readEntireNetwork(ninfile, numNodes, mat);
-	std::cout << "Completed reading network of " << sizeof(float) * matrixWidth * matrixWidth / (1024*1024*1024.0) << "GB." << std::endl;
-      
       }
 
       TIndicesGroups igroups;
-      mapGroupsToIndices<std::string>(groups, map, igroups);
+      mapGroupsToIndices(groups, map, igroups);
         
       // Score genes based on strong modules
       std::cout << "Scoring genes." << std::endl;
@@ -273,20 +473,16 @@ int main(int argc, char** argv) {
 	}
       }
     
-      moduleScorer->ScoreModule(mat, matrixWidth, igroups, inds, scores);
+      moduleScorer->ScoreModule(*similarities, igroups, inds, scores);
 
-      TReverseIndexMap rmap2;
-      for (auto const &p : map) {
-	rmap2[p.second] = p.first;
-      }
-      moduleScorer->BriefSummary(scores, rmap2, std::cout);
+      moduleScorer->BriefSummary(scores, map, std::cout);
 
       // Write summary to file.
       std::string outFile = outFilename.getValue();
       if (outFile != "") {
 	std::cout << std::endl << "Writing summary to output file " << outFile << std::endl;
 	std::ofstream outStream(outFile, std::ofstream::out);
-	moduleScorer->LongSummary(scores, rmap2, igroups, outStream);
+	moduleScorer->LongSummary(scores, map, igroups, outStream);
       }
     }
     else {
@@ -297,16 +493,13 @@ int main(int argc, char** argv) {
 	// Allocate a big block of memory. This could easily fail.
 	matrixWidth = numNodes;
 	map = fullMap;
-	std::cout << "Reading entire network into memory. This may take a while." << std::endl;
-	mat = (float*)malloc(sizeof(float) * matrixWidth * matrixWidth);
-	if (mat == 0) {
-	  std::cerr << "Could not allocate matrix buffer of ";
-	  std::cerr << (int)(matrixWidth * matrixWidth * sizeof(float)) << " bytes." << std::endl;
-	  exit(-1);
+	if (sparse) {
+	  similarities = readSparseSimilarities(nfilename, ninfile, bundle, bundled, numNodes,
+						topK.getValue(), minKept, missingSimilarity.getValue(), numThreads.getValue());
+	} else {
+	  similarities = readFullSimilarities(nfilename, ninfile, bundle, bundled, numNodes, packed.getValue(), mat,
+					      numThreads.getValue());
 	}
-	// Read the network from the stream
-	readEntireNetwork(ninfile, numNodes, mat);
-	std::cout << "Completed reading network of " << sizeof(float) * matrixWidth * matrixWidth / (1024*1024*1024.0) << "GB." << std::endl;
 
 	std::map<int, int> nodeDegreeGroups;
 	if (pIterations > 0) {
@@ -315,8 +508,8 @@ int main(int argc, char** argv) {
 	  //std::string dFileName = degree.getValue();
 	  std::string dFileName = "";
 	  if (dFileName == "") {
-	    for (auto const& i : fullMap) {
-	      nodeDegreeGroups[i.second] = 0;
+	    for (int i = 0; i < fullMap.size(); ++i) {
+	      nodeDegreeGroups[i] = 0;
 	    }
 	  } else {
 	    if (false == readDegreeGroups(dFileName, fullMap, nodeDegreeGroups)) {
@@ -338,7 +531,7 @@ int main(int argc, char** argv) {
 	}
 	for (const auto &disease : diseases) {
 	  TIndicesGroups igroups;
-	  mapGroupsToIndices<std::string>(disease.second, map, igroups);
+	  mapGroupsToIndices(disease.second, map, igroups);
 	  TIndices inds;
 	  for (auto const& g : igroups) {
 	    for (auto i : g.second) {
@@ -346,20 +539,16 @@ int main(int argc, char** argv) {
 	    }
 	  }
 	  TScoreMap scores;
-      	  moduleScorer->ScoreModule(mat, matrixWidth, igroups, inds, scores);
+      	  moduleScorer->ScoreModule(*similarities, igroups, inds, scores);
 	  
-	  TReverseIndexMap rmap2;
-	  for (auto const &p : map) {
-	    rmap2[p.second] = p.first;
-	  }
 	  printf("%s\n", disease.first.c_str());
-	  moduleScorer->BriefSummary(scores, rmap2, std::cout);
+	  moduleScorer->BriefSummary(scores, map, std::cout);
 	  printf("\n\n");
 	  if (outFile != "") {
 	    *outStream << "-------------------" << std::endl;
 	    *outStream << disease.first << std::endl;
 	    *outStream << "-------------------" << std::endl;
-	    moduleScorer->LongSummary(scores, rmap2, igroups, *outStream);
+	    moduleScorer->LongSummary(scores, map, igroups, *outStream);
 	  }
 	}
 	if (outStream) delete outStream;
@@ -371,6 +560,7 @@ int main(int argc, char** argv) {
     
 
     // Delete heap stuffs.
+    delete similarities;
     free(mat);
     delete moduleScorer;
       
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+#include "coreroutines.h"
+#include "NetworkBundle.h"
+#include "MatrixParser.h"
+#include "CompressedStream.h"
+#include <cstring>
+
+const char* layoutName(const TSimilarityLayout layout) {
+  switch (layout) {
+  case kPackedLayout:
+    return "packed";
+  case kHalfLayout:
+    return "fp16";
+  case kInt8Layout:
+    return "int8";
+  default:
+    return "dense";
+  }
+}
+
+bool checkBundle(const std::string& filename) {
+  NetworkBundle bundle;
+  if (!bundle.open(filename)) {
+    return false;
+  }
+  if (!bundle.verifyChecksum()) {
+    printf("Checksum mismatch in %s.\n", filename.c_str());
+    return false;
+  }
+  if (bundle.layout() == kFactorLayout) {
+    printf("%s: %d nodes, factor of rank %d, checksum ok.\n", filename.c_str(), bundle.numNodes(), bundle.rank());
+  } else {
+    printf("%s: %d nodes, %s, checksum ok.\n", filename.c_str(), bundle.numNodes(), layoutName(bundle.layout()));
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  TCLAP::CmdLine cmd("Convert a text similarity matrix into a binary network bundle.", ' ', "0.9");
+  TCLAP::ValueArg<std::string> matrixFilename("m", "matrix", "Text similarity matrix, or a bundle to check", true, "", "string");
+  cmd.add(matrixFilename);
+  TCLAP::ValueArg<std::string> outFilename("o", "outfile", "Output bundle file", false, "", "string");
+  cmd.add(outFilename);
+  TCLAP::SwitchArg packed("p", "packed", "Store only the upper triangle of the symmetric matrix", false);
+  cmd.add(packed);
+  TCLAP::SwitchArg verify("v", "verify", "Re-read the bundle and check its checksum", false);
+  cmd.add(verify);
+  TCLAP::ValueArg<std::string> quantize("q", "quantize", "Store values at reduced precision: fp16, or int8 with a scale per row", false, "", "string");
+  cmd.add(quantize);
+
+  cmd.parse(argc, argv);
+
+  TSimilarityLayout layout = packed.getValue() ? kPackedLayout : kDenseLayout;
+  if (quantize.isSet()) {
+    if (quantize.getValue() == "fp16") {
+      layout = kHalfLayout;
+    } else if (quantize.getValue() == "int8") {
+      layout = kInt8Layout;
+    } else {
+      printf("Unknown --quantize format '%s'; use fp16 or int8.\n", quantize.getValue().c_str());
+      return(-1);
+    }
+    if (packed.getValue()) {
+      printf("Quantized bundles hold the full matrix; --quantize cannot be combined with --packed.\n");
+      return(-1);
+    }
+  }
+
+  const std::string mfilename = matrixFilename.getValue();
+  const std::string ofilename = outFilename.getValue();
+  if (isNetworkBundle(mfilename)) {
+    return checkBundle(mfilename) ? 0 : -1;
+  }
+  if (ofilename == "") {
+    printf("An output file is required to convert %s.\n", mfilename.c_str());
+    return(-1);
+  }
+
+  // Plain matrices are parsed straight out of a mapping; compressed ones
+  // are streamed through the decompressor a line at a time.
+  MappedFile mapped;
+  MatrixInputStream stream(mfilename);
+  const bool compressed = stream.compressed();
+  if (!stream || (!compressed && !mapped.open(mfilename))) {
+    printf("Problem reading matrix from file %s\n", mfilename.c_str());
+    return(-1);
+  }
+  mapped.adviseSequential();
+  const char* p = mapped.data();
+  const char* const end = p + mapped.size();
+  const char* nl(0);
+  const char* lineEnd(0);
+  std::string line;
+  std::vector<std::string> names;
+  int numNodes(0);
+  if (compressed) {
+    std::getline(stream, line);
+    numNodes = parseNamesLine(line, names);
+  } else {
+    nl = (const char*)memchr(p, '\n', end - p);
+    lineEnd = (nl == 0) ? end : nl;
+    numNodes = parseNamesLine(std::string(p, lineEnd), names);
+    p = (nl == 0) ? end : nl + 1;
+  }
+
+  NetworkBundleWriter writer;
+  if (!writer.begin(ofilename, names, layout)) {
+    return(-1);
+  }
+
+  // Stream the matrix one row at a time. Short rows are zero filled.
+  std::vector<float> row(numNodes);
+  for (int i = 0; i < numNodes; ++i) {
+    std::fill(row.begin(), row.end(), 0.0f);
+    if (compressed) {
+      if (std::getline(stream, line)) {
+	parseMatrixRow(line, numNodes, &row[0]);
+      }
+    } else if (p < end) {
+      nl = (const char*)memchr(p, '\n', end - p);
+      lineEnd = (nl == 0) ? end : nl;
+      parseMatrixLine(p, lineEnd, numNodes, &row[0]);
+      p = (nl == 0) ? end : nl + 1;
+    }
+    if (!writer.writeRow(&row[0])) {
+      return(-1);
+    }
+  }
+  if (!writer.finish()) {
+    printf("Problem writing bundle %s\n", ofilename.c_str());
+    return(-1);
+  }
+  printf("Wrote %d x %d %s bundle to %s\n", numNodes, numNodes, layoutName(layout), ofilename.c_str());
+
+  if (verify.getValue() && !checkBundle(ofilename)) {
+    return(-1);
+  }
+  return 0;
+}
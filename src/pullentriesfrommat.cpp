@@ -1,38 +1,17 @@
 #include <stdio.h>
 #include <cstring>
 #include <string>
-#include <map>
-#include <utility>
 #include <sstream>
 #include <vector>
+#include <cmath>
+#include <algorithm>
 #include <tclap/CmdLine.h>
 
 #include "coreroutines.h"
-
-#define LINE_SIZE 2048
-typedef std::map< std::pair< std::string, std::string >, float> NetMap;
-typedef std::map<std::string, int> IndexMap;
-
-bool readnetwork(FILE* fp, NetMap& network, IndexMap& indices) {
-  char line[LINE_SIZE];
-  int i = 0;
-  
-  while (fgets(line, LINE_SIZE, fp) != 0) {
-    char* a = strtok(line, "\t");
-    char* b = strtok(0, "\t");
-    char* c = strtok(0, "\t");
-    float score = atof(c);
-    //printf("%s, %s, %f\n", a, b, score);
-    network[std::pair<std::string, std::string>(a, b)] = score;
-    if (indices.find(a) == indices.end()) {
-      indices[a] = i++;
-    }
-    if (indices.find(b) == indices.end()) {
-      indices[b] = i++;
-    }
-  }
-}
-
+#include "MappedFile.h"
+#include "MatrixParser.h"
+#include "CompressedStream.h"
+#include "EdgeList.h"
 
 int main(int argc, char** argv)
 {
@@ -48,25 +27,31 @@ int main(int argc, char** argv)
   cmd.parse(argc, argv);
 
   std::string mfilename = matrixFilename.getValue();
-  std::ifstream minfile(mfilename);
+  MatrixInputStream minfile(mfilename);
   std::string line;
   std::getline(minfile, line);
-  TIndexMap fullMap, map;
+  GeneDictionary fullMap, map;
   int numNodes = parseNamesLine(line, fullMap);
 
   std::string efilename = edgesFilename.getValue();
-  FILE* f = fopen(efilename.c_str(), "r");
-  if (f == 0) {
+  MatrixInputStream einfile(efilename);
+  GeneDictionary edgeGenes;
+  std::vector<TEdge> edges;
+  if (!einfile.good() || !readEdgeList(einfile, edgeGenes, edges)) {
     printf("Problem reading network from file %s\n", efilename.c_str());
     return(-1);
   }
-  NetMap net;
-  IndexMap indices;
-  readnetwork(f, net, indices);
-  fclose(f);
+  // Every requested (A, B) is printed once, in the direction it was listed;
+  // (B, A) is a line of its own when it is listed too.
+  std::stable_sort(edges.begin(), edges.end(), [](const TEdge& a, const TEdge& b) {
+      return a.from < b.from || (a.from == b.from && a.to < b.to);
+    });
+  edges.erase(std::unique(edges.begin(), edges.end(), [](const TEdge& a, const TEdge& b) {
+	return a.from == b.from && a.to == b.to;
+      }), edges.end());
 
   // Allocate memory for subnework
-  int matrixWidth(indices.size());
+  int matrixWidth(edgeGenes.size());
   float* mat = 0;
   mat = (float*)malloc(sizeof(float) * matrixWidth * matrixWidth);
   if (mat == 0) {
@@ -75,19 +60,26 @@ int main(int argc, char** argv)
     exit(-1);
   }
 
-  std::vector<std::string> entries;
-  for (const auto &item : indices) {
-    entries.push_back(item.first);
-  }
+  const std::vector<std::string>& entries = edgeGenes.names();
   
-  readEntriesFromNetwork(minfile, fullMap, entries, map, mat, matrixWidth);
+  MappedFile mapped;
+  MatrixIndex index;
+  const std::streamoff offset = minfile.tellg();
+  const bool indexed = openMatrixIndex(mfilename, index);
+  if (offset < 0 || !mapped.open(mfilename) ||
+      !readEntriesFromNetwork(mapped, offset, fullMap, entries, map, mat, matrixWidth,
+			      indexed ? &index : 0)) {
+    readEntriesFromNetwork(minfile, fullMap, entries, map, mat, matrixWidth);
+  }
 
-  for (const auto &e : net) {
-    const auto edge = e.first;
-    const int i1 = map[edge.first];
-    const int i2 = map[edge.second];
-    const float val = mat[i1 * matrixWidth + i2];
-    printf("%s\t%s\t%e\n", edge.first.c_str(), edge.second.c_str(), val);
+  for (const auto &e : edges) {
+    const std::string& first = edgeGenes.name(e.from);
+    const std::string& second = edgeGenes.name(e.to);
+    const int i1 = map.find(first);
+    const int i2 = map.find(second);
+    // Genes missing from the matrix have no similarity.
+    const float val = (i1 < 0 || i2 < 0) ? NAN : mat[i1 * matrixWidth + i2];
+    printf("%s\t%s\t%e\n", first.c_str(), second.c_str(), val);
   }
   
   return 0;